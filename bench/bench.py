@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+"""Runs the benchmark programs through every execution mode.
+
+Builds bf_interpreter and bf_compiler from this checkout, then runs each
+program through the interpreter, the -O0/-O1/-O2 C backends, -jit and -elf.
+For each mode it reports compile time, run time, instructions per second and
+peak RSS, and checks that every mode produced the same output as the
+interpreter (and the program's .out file, when there is one).
+
+Programs are the .bf files in bench/programs, or the paths given on the
+command line. A program reads <name>.in when that file exists, otherwise a
+generated block of text (--io-bytes long).
+
+Instructions per second is the number of IR instructions the interpreter
+executes for the program (bf_interpreter --count) over the run time, so the
+figures of different modes are directly comparable.
+"""
+
+import argparse
+import glob
+import hashlib
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+MODES = ["interpreter", "O0", "O1", "O2", "jit", "elf"]
+
+# A process started straight from Python reports Python's peak RSS as its
+# own (the high-water mark survives fork and exec), so every measured run is
+# started by this small runner instead, the way time(1) does it
+RUNNER_SOURCE = r"""
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char** argv)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(argv[1], argv + 1);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "bench-runner %d %.9f %ld\n", WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, usage.ru_maxrss);
+    return 0;
+}
+"""
+
+
+def run(runner, command, stdin_path, stdout_path, cwd):
+    """Runs command, returns (exit status, seconds, peak RSS in KiB)."""
+    with open(stdin_path, "rb") as stdin, open(stdout_path, "wb") as stdout:
+        result = subprocess.run([runner] + command, stdin=stdin, stdout=stdout, stderr=subprocess.PIPE,
+                                cwd=cwd, universal_newlines=True)
+    for line in result.stderr.splitlines():
+        if line.startswith("bench-runner "):
+            status, elapsed, rss = line.split()[1:]
+            return int(status), float(elapsed), int(rss)
+    return 1, 0.0, 0
+
+
+def digest(path):
+    with open(path, "rb") as file:
+        return hashlib.sha256(file.read()).hexdigest()
+
+
+def build_tools(work, cxx, cxxflags):
+    tools = {}
+    for name in ("bf_interpreter", "bf_compiler"):
+        tools[name] = os.path.join(work, name)
+        command = [cxx] + cxxflags.split() + ["-o", tools[name], os.path.join(ROOT, name + ".cpp")]
+        if subprocess.call(command):
+            sys.exit("error: could not build " + name)
+
+    runner_source = os.path.join(work, "runner.cpp")
+    with open(runner_source, "w") as file:
+        file.write(RUNNER_SOURCE)
+    tools["runner"] = os.path.join(work, "runner")
+    if subprocess.call([cxx, "-O2", "-o", tools["runner"], runner_source]):
+        sys.exit("error: could not build the runner")
+    return tools
+
+
+def generated_input(work, size):
+    """Deterministic printable text with newlines, the same on every run."""
+    path = os.path.join(work, "generated.in")
+    rng = random.Random(1)
+    alphabet = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 .,;:!?"
+    lines = []
+    total = 0
+    while total < size:
+        line = "".join(rng.choice(alphabet) for _ in range(rng.randint(10, 120))) + "\n"
+        lines.append(line)
+        total += len(line)
+    with open(path, "w") as file:
+        file.write("".join(lines)[:size])
+    return path
+
+
+def count_instructions(tools, program, stdin_path, work):
+    output = os.path.join(work, "count.out")
+    with open(stdin_path, "rb") as stdin, open(output, "wb") as stdout:
+        result = subprocess.run([tools["bf_interpreter"], program, "--count"], stdin=stdin, stdout=stdout,
+                                stderr=subprocess.PIPE, universal_newlines=True)
+    for line in result.stderr.splitlines():
+        if line.startswith("Executed "):
+            return int(line.split()[1])
+    return 0
+
+
+def benchmark(tools, program, mode, stdin_path, work, args):
+    """Returns (compile seconds or None, run seconds, peak RSS KiB, output path, exit status)."""
+    name = os.path.splitext(os.path.basename(program))[0]
+    output = os.path.join(work, "%s.%s.out" % (name, mode))
+    compile_time = None
+
+    if mode == "interpreter":
+        command = [tools["bf_interpreter"], program]
+    elif mode == "jit":
+        command = [tools["bf_compiler"], program, "-jit", "-no-cache"]
+    else:
+        executable = os.path.join(work, "%s-%s.exe" % (name, mode))
+        compile_command = [tools["bf_compiler"], program, "-no-cache", "-o", executable]
+        if mode == "elf":
+            compile_command.append("-elf")
+        else:
+            compile_command += ["-" + mode, "-Oc" + args.gcc_opt]
+        start = time.perf_counter()
+        status = subprocess.call(compile_command, cwd=work, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        compile_time = time.perf_counter() - start
+        if status:
+            return compile_time, 0.0, 0, None, status
+        command = [executable]
+
+    best_time, peak_rss, status = None, 0, 0
+    for _ in range(args.repeat):
+        status, elapsed, rss = run(tools["runner"], command, stdin_path, output, work)
+        if status:
+            break
+        best_time = elapsed if best_time is None else min(best_time, elapsed)
+        peak_rss = max(peak_rss, rss)
+    return compile_time, best_time or 0.0, peak_rss, output, status
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("programs", nargs="*", help="programs to run (default: bench/programs/*.bf)")
+    parser.add_argument("--modes", default=",".join(MODES), help="comma-separated subset of " + ", ".join(MODES))
+    parser.add_argument("--repeat", type=int, default=3, help="runs per mode, the fastest counts (default 3)")
+    parser.add_argument("--io-bytes", type=int, default=8 << 20, help="size of the generated input (default 8 MiB)")
+    parser.add_argument("--gcc-opt", default="2", help="-Oc level for the C backends (default 2)")
+    parser.add_argument("--cxx", default=os.environ.get("CXX", "g++"), help="compiler for the tools (default $CXX or g++)")
+    parser.add_argument("--cxxflags", default="-O2", help="flags for the tools (default -O2)")
+    parser.add_argument("--csv", help="also write the results to this file")
+    args = parser.parse_args()
+
+    modes = [mode for mode in args.modes.split(",") if mode]
+    unknown = [mode for mode in modes if mode not in MODES]
+    if unknown:
+        sys.exit("error: unknown mode " + ", ".join(unknown))
+
+    programs = args.programs or sorted(glob.glob(os.path.join(ROOT, "bench", "programs", "*.bf")))
+    programs = [os.path.abspath(program) for program in programs]
+
+    work = tempfile.mkdtemp(prefix="bf_bench_")
+    rows = []
+    failures = 0
+    try:
+        tools = build_tools(work, args.cxx, args.cxxflags)
+        default_input = generated_input(work, args.io_bytes)
+
+        header = "%-14s %-12s %10s %10s %12s %9s  %s" % ("program", "mode", "compile s", "run s", "Minstr/s", "RSS MiB", "output")
+        print(header)
+        print("-" * len(header))
+
+        for program in programs:
+            name = os.path.splitext(os.path.basename(program))[0]
+            own_input = os.path.splitext(program)[0] + ".in"
+            stdin_path = own_input if os.path.exists(own_input) else default_input
+            expected_path = os.path.splitext(program)[0] + ".out"
+            expected = digest(expected_path) if os.path.exists(expected_path) else None
+            instructions = count_instructions(tools, program, stdin_path, work)
+            reference = None
+
+            for mode in modes:
+                compile_time, run_time, rss, output, status = benchmark(tools, program, mode, stdin_path, work, args)
+
+                if status or not output:
+                    verdict = "FAILED (exit %d)" % status
+                else:
+                    result = digest(output)
+                    reference = reference or expected or result
+                    verdict = "ok" if result == reference else "MISMATCH"
+                if verdict != "ok":
+                    failures += 1
+
+                rate = instructions / run_time / 1e6 if run_time > 0 and not status else 0.0
+                print("%-14s %-12s %10s %10.4f %12.1f %9.1f  %s" % (
+                    name, mode, "-" if compile_time is None else "%.4f" % compile_time,
+                    run_time, rate, rss / 1024.0, verdict))
+                sys.stdout.flush()
+                rows.append((name, mode, compile_time, run_time, instructions, rate, rss, verdict))
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+
+    if args.csv:
+        with open(args.csv, "w") as file:
+            file.write("program,mode,compile_s,run_s,instructions,minstr_per_s,rss_kib,output\n")
+            for name, mode, compile_time, run_time, instructions, rate, rss, verdict in rows:
+                file.write("%s,%s,%s,%.6f,%d,%.3f,%d,%s\n" % (
+                    name, mode, "" if compile_time is None else "%.6f" % compile_time,
+                    run_time, instructions, rate, rss, verdict))
+
+    if failures:
+        print("\n%d run(s) failed or did not match" % failures)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,4 @@
+Echo: copies stdin to stdout
+Needs end of input stored as 255 (the default) or left unchanged
+
+-,+[-.,+]
@@ -0,0 +1,18 @@
+Loop idioms: 200 * 200 times build a run of 250 non-zero cells with a
+multiplication loop, find its start with a scan loop and clear it cell by
+cell; prints a newline at the end
+
+>>+++++[<<++++++++++++++++++++++++++++++++++++++++>>-]<<
+[
+    >>+++++[<++++++++++++++++++++++++++++++++++++++++>-]<
+    [
+        >>>++++++++++[<+++++++++++++++++++++++++>-]<
+        [[->+<]+>-]
+        <[<]
+        >[[-]>]
+        <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+        -
+    ]
+    <-
+]
+++++++++++.
@@ -0,0 +1,18 @@
+Nested counting loops: 200 * 200 * 200 passes over a 16 step inner loop
+that none of the loop idioms cover; prints the low byte of the count plus 48
+
+>>>>>>+++++[<<<<<<++++++++++++++++++++++++++++++++++++++++>>>>>>-]<<<<<<
+[
+    >>>>>>+++++[<<<<<++++++++++++++++++++++++++++++++++++++++>>>>>-]<<<<<
+    [
+        >>>>>+++++[<<<<++++++++++++++++++++++++++++++++++++++++>>>>-]<<<<
+        [
+            >++++++++++++++++
+            [->+>[-]+<<]
+            <-
+        ]
+        <-
+    ]
+    <-
+]
+>>>>++++++++++++++++++++++++++++++++++++++++++++++++.[-]++++++++++.
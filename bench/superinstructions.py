@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""Mines opcode n-grams from a corpus and generates bf_fused.hpp.
+
+Builds bf_interpreter from this checkout and runs every program with
+--write-ngrams, which counts how often each sequence of 2 or 3 opcodes ran
+back to back. Each program's counts are taken as shares of the instructions
+it executed and averaged over the corpus, so a long-running program does not
+drown out the others. Fusing a pair saves one dispatch every time it runs,
+so the pairs with the largest average share become the superinstructions of
+the threaded engine.
+
+Programs are the .bf files in bench/programs, or the paths given on the
+command line; like bench/bench.py, a program reads <name>.in when that file
+exists, otherwise a generated block of text (--io-bytes long). The ranking is
+always printed. bf_fused.hpp is only rewritten with --write.
+"""
+
+import argparse
+import collections
+import glob
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import bench
+
+# Opcodes as bf_interpreter --write-ngrams names them, for those the fused
+# handlers can be built from: an instruction with at most one operand, since
+# a superinstruction carries one for each half
+FUSABLE = {
+    "add": "OP_ADD", "move": "OP_MOVE", "out": "OP_OUT", "in": "OP_IN", "[": "OP_JZ", "]": "OP_JNZ",
+    "clear": "OP_CLEAR", "scan": "OP_SCAN", "set": "OP_SET", "put": "OP_PUT",
+}
+
+
+def mine(interpreter, program, stdin_path, work):
+    """Returns (instructions executed, {ngram tuple: count}) for one program."""
+    path = os.path.join(work, "ngrams.txt")
+    with open(stdin_path, "rb") as stdin:
+        result = subprocess.run([interpreter, program, "--write-ngrams=" + path], stdin=stdin,
+                                stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, universal_newlines=True)
+    if result.returncode:
+        sys.exit("error: %s failed: %s" % (program, result.stderr.strip()))
+
+    ngrams = {}
+    with open(path) as file:
+        header = file.readline().split()
+        if header[:2] != ["bf-ngrams", "1"]:
+            sys.exit("error: unexpected n-gram file from " + program)
+        total = int(header[2])
+        for line in file:
+            fields = line.split()
+            ngrams[tuple(fields[1:])] = int(fields[0])
+    return total, ngrams
+
+
+def write_header(path, pairs, programs):
+    lines = [
+        "#pragma once",
+        "",
+        "// Generated by bench/superinstructions.py, do not edit. Pairs of",
+        "// instructions the threaded engine runs as one superinstruction, ranked by",
+        "// their average share of executed instructions over the corpus:",
+        "//",
+    ]
+    lines += ["//   %-12s %6.2f%%" % (" ".join(pair), share * 100) for pair, share in pairs]
+    lines += [
+        "//",
+        "// Corpus: " + ", ".join(os.path.basename(program) for program in programs),
+        "#define BF_FUSED_PAIRS(X)" + (" \\" if pairs else ""),
+    ]
+    for i, (pair, _) in enumerate(pairs):
+        lines.append("    X(%s, %s)%s" % (FUSABLE[pair[0]], FUSABLE[pair[1]], " \\" if i + 1 < len(pairs) else ""))
+
+    with open(path, "w") as file:
+        file.write("\n".join(lines) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("programs", nargs="*", help="programs to mine (default: bench/programs/*.bf)")
+    parser.add_argument("--pairs", type=int, default=16, help="most superinstructions to generate (default 16)")
+    parser.add_argument("--min-share", type=float, default=0.5, help="least average share of a pair, in percent (default 0.5)")
+    parser.add_argument("--io-bytes", type=int, default=1 << 20, help="size of the generated input (default 1 MiB)")
+    parser.add_argument("--cxx", default=os.environ.get("CXX", "g++"), help="compiler for the interpreter (default $CXX or g++)")
+    parser.add_argument("--cxxflags", default="-O2", help="flags for the interpreter (default -O2)")
+    parser.add_argument("--write", action="store_true", help="rewrite bf_fused.hpp with the chosen pairs")
+    args = parser.parse_args()
+
+    programs = args.programs or sorted(glob.glob(os.path.join(bench.ROOT, "bench", "programs", "*.bf")))
+    programs = [os.path.abspath(program) for program in programs]
+
+    work = tempfile.mkdtemp(prefix="bf_ngrams_")
+    shares = collections.defaultdict(float)
+    try:
+        interpreter = os.path.join(work, "bf_interpreter")
+        command = [args.cxx] + args.cxxflags.split() + ["-o", interpreter, os.path.join(bench.ROOT, "bf_interpreter.cpp")]
+        if subprocess.call(command):
+            sys.exit("error: could not build bf_interpreter")
+        default_input = bench.generated_input(work, args.io_bytes)
+
+        for program in programs:
+            own_input = os.path.splitext(program)[0] + ".in"
+            total, ngrams = mine(interpreter, program, own_input if os.path.exists(own_input) else default_input, work)
+            for ngram, count in ngrams.items():
+                shares[ngram] += count / total / len(programs) if total else 0.0
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+
+    for length in (2, 3):
+        ranked = sorted((ngram for ngram in shares if len(ngram) == length), key=lambda ngram: -shares[ngram])
+        print("%d-grams by average share of executed instructions" % length)
+        for ngram in ranked[:20]:
+            print("  %-20s %6.2f%%" % (" ".join(ngram), shares[ngram] * 100))
+        print()
+
+    candidates = sorted((ngram for ngram in shares if len(ngram) == 2 and all(op in FUSABLE for op in ngram)),
+                        key=lambda ngram: -shares[ngram])
+    pairs = [(pair, shares[pair]) for pair in candidates if shares[pair] * 100 >= args.min_share][:args.pairs]
+    print("Superinstructions: " + (", ".join(" ".join(pair) for pair, _ in pairs) or "none"))
+
+    if args.write:
+        path = os.path.join(bench.ROOT, "bf_fused.hpp")
+        write_header(path, pairs, programs)
+        print("Wrote " + path)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""Checks that programs leaving the tape stop with a tape error in every mode.
+
+Builds bf_interpreter and bf_compiler from this checkout and runs a few
+programs that move off either end of a small tape, most of them through scan
+loops such as [<] or [>>>], which no engine reads cell by cell. Each must
+exit with status 1 and the matching error, and print nothing, through the
+interpreter (threaded, --checked, --tiered, 16-bit cells), the -O0/-O1/-O2
+C backends (also with -checked and 16-bit cells) and -jit. -elf is left out:
+its executables have no fault handler and die from SIGSEGV instead.
+"""
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import bench
+
+TAPE_SIZE = 4096
+LEFT = "Error: The program moved left of the first cell"
+RIGHT = "Error: The program ran past the end of the tape, give it a larger tape size"
+
+# A tape of non-zero cells with the pointer back on the first one
+FILLED = "+" + ">+" * (TAPE_SIZE - 1) + "<" * (TAPE_SIZE - 1)
+
+PROGRAMS = [
+    ("move-left", "<+.", LEFT),
+    ("scan-left", "+[<]>.", LEFT),
+    ("scan-left-stride", "+>+>+[<<]>>.", LEFT),
+    ("scan-left-nested", "+[[<]>-]", LEFT),
+    ("scan-right", FILLED + "[>]<.", RIGHT),
+    ("scan-right-stride", FILLED + "[>>>]<<<.", RIGHT),
+]
+
+INTERPRETER_MODES = [[], ["--checked"], ["--tiered=1"], ["--cell-bits=16"]]
+COMPILER_MODES = [["-O0"], ["-O1"], ["-O2"], ["-O1", "-checked"], ["-O1", "-cell-bits=16"], ["-jit"]]
+
+
+def check(command, expected, cwd):
+    """Returns None if command failed the expected way, otherwise what went wrong."""
+    result = subprocess.run(command, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, stderr=subprocess.PIPE, cwd=cwd)
+    stderr = result.stderr.decode(errors="replace")
+    if result.returncode != 1 or expected not in stderr or result.stdout:
+        return "exit status %d, output %r, stderr %r" % (result.returncode, result.stdout[:16], stderr.strip()[-200:])
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--cxx", default=os.environ.get("CXX", "g++"), help="compiler for the tools (default $CXX or g++)")
+    parser.add_argument("--cxxflags", default="-O2", help="flags for the tools (default -O2)")
+    args = parser.parse_args()
+
+    work = tempfile.mkdtemp(prefix="bf_tape_errors_")
+    failures = 0
+    try:
+        tools = bench.build_tools(work, args.cxx, args.cxxflags)
+        size = "%d" % TAPE_SIZE
+
+        for name, source, expected in PROGRAMS:
+            program = os.path.join(work, name + ".bf")
+            with open(program, "w") as file:
+                file.write(source)
+
+            runs = []
+            for mode in INTERPRETER_MODES:
+                runs.append(("interpreter " + " ".join(mode), [tools["bf_interpreter"], program, "--tape-size=" + size] + mode))
+            for mode in COMPILER_MODES:
+                compile_command = [tools["bf_compiler"], program, "-no-cache", "-tape-size=" + size] + mode
+                if mode != ["-jit"]:
+                    executable = os.path.join(work, name + ".exe")
+                    if subprocess.call(compile_command + ["-o", executable], cwd=work,
+                                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL):
+                        print("FAIL %-18s %-22s does not compile" % (name, " ".join(mode)))
+                        failures += 1
+                        continue
+                    compile_command = [executable]
+                runs.append((" ".join(mode), compile_command))
+
+            for mode, command in runs:
+                problem = check(command, expected, work)
+                print("%s %-18s %-22s %s" % ("FAIL" if problem else "ok  ", name, mode, problem or ""))
+                failures += problem is not None
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+
+    print("%d failure%s" % (failures, "" if failures == 1 else "s"))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "bf_ir.hpp"
+#include "bf_lib.hpp"
+
+// A .bfc file is a program after parsing and optimization, ready to run:
+//
+//   bytecode_header
+//   instructions      bytecode_instruction[instructions], jumps resolved
+//   output            output_size bytes printed by compile-time evaluation
+//   tape              tape_size bytes of cells at cell_bits, left by it
+//
+// Without a snapshot (cell_bits 0) the program starts at instruction 0 on an
+// empty tape and runs at any width. With one it starts by printing output,
+// on the snapshot tape, at instruction entry with the pointer on entry_cell.
+// A program built with -checked keeps its bounds checks as instructions and
+// runs checked wherever it is loaded. Everything is little-endian, the byte
+// order of every host the tools run on; a big-endian host fails the version
+// check.
+#define BYTECODE_MAGIC "\x89" "BFC\r\n\x1A\n"
+#define BYTECODE_VERSION 2u
+
+struct bytecode_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t cell_bits;
+    uint64_t instructions;
+    uint64_t entry;
+    uint64_t entry_cell;
+    uint64_t output_size;
+    uint64_t tape_size;
+};
+
+struct bytecode_instruction
+{
+    int32_t arg;
+    int32_t offset;
+    uint8_t op;
+    uint8_t padding[3];
+};
+
+static_assert(sizeof(bytecode_header) == 56, "bytecode_header must not be padded");
+static_assert(sizeof(bytecode_instruction) == 12, "bytecode_instruction must not be padded");
+
+inline bool is_bytecode(const char* data, const size_t size)
+{
+    return size >= 8 && memcmp(data, BYTECODE_MAGIC, 8) == 0;
+}
+
+// Writes program and, if given, the snapshot compile-time evaluation left at
+// cell_bits; prints the reason and returns false on failure
+inline bool bytecode_write(const char* path, const std::vector<instruction>& program, const unsigned cell_bits,
+                           const evaluation_state* snapshot)
+{
+    const size_t cell_size = cell_bits / 8;
+
+    // Only the cells up to the last non-zero one are stored
+    size_t used = snapshot && !snapshot->finished ? snapshot->tape.size() : 0;
+    while (used && !snapshot->tape[used - 1])
+        --used;
+
+    bytecode_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BYTECODE_MAGIC, 8);
+    header.version = BYTECODE_VERSION;
+    header.cell_bits = snapshot ? cell_bits : 0;
+    header.instructions = program.size();
+    header.output_size = snapshot ? snapshot->output.size() : 0;
+    header.tape_size = used * cell_size;
+
+    // A finished evaluation leaves nothing to do but the final OP_END
+    if (snapshot)
+    {
+        header.entry = snapshot->finished ? program.size() - 1 : snapshot->pc;
+        header.entry_cell = snapshot->finished ? 0 : static_cast<uint64_t>(snapshot->ptr);
+    }
+
+    std::vector<uint8_t> image(sizeof(header) + program.size() * sizeof(bytecode_instruction) + header.output_size + header.tape_size);
+    uint8_t* at = image.data();
+    memcpy(at, &header, sizeof(header));
+    at += sizeof(header);
+
+    for (const instruction& ins : program)
+    {
+        bytecode_instruction record = { ins.arg, ins.offset, ins.op, { 0, 0, 0 } };
+        memcpy(at, &record, sizeof(record));
+        at += sizeof(record);
+    }
+
+    if (header.output_size)
+    {
+        memcpy(at, snapshot->output.data(), header.output_size);
+        at += header.output_size;
+    }
+
+    for (size_t i = 0; i < used; ++i)
+    {
+        for (size_t byte = 0; byte < cell_size; ++byte)
+            *at++ = static_cast<uint8_t>(snapshot->tape[i] >> (8 * byte));
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        perror(path);
+        return false;
+    }
+
+    const bool written = fwrite(image.data(), 1, image.size(), file) == image.size();
+    if (fclose(file) || !written)
+    {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+// Checks that the instructions cannot take an engine anywhere the optimizer
+// could not have: known opcodes, matching jumps, non-zero scans, exactly one
+// OP_END at the end
+inline bool bytecode_valid(const std::vector<instruction>& program)
+{
+    std::vector<size_t> loop_stack;
+
+    for (size_t i = 0; i < program.size(); ++i)
+    {
+        const instruction& ins = program[i];
+        if (ins.op > OP_END || (ins.op == OP_END) != (i + 1 == program.size()) || (ins.op == OP_SCAN && !ins.arg))
+            return false;
+
+        if (ins.op == OP_JZ)
+            loop_stack.push_back(i);
+        else if (ins.op == OP_JNZ)
+        {
+            if (loop_stack.empty() || static_cast<size_t>(ins.arg) != loop_stack.back() ||
+                static_cast<size_t>(program[loop_stack.back()].arg) != i)
+                return false;
+            loop_stack.pop_back();
+        }
+    }
+    return !program.empty() && loop_stack.empty();
+}
+
+// Loads the size bytes of a .bfc file at data (as mapped by open_source),
+// prints the reason and returns false on failure. Nothing is parsed or
+// optimized, the instructions are copied over as they are.
+inline bool bytecode_load(const char* path, const char* data, const size_t size, bf_program& program)
+{
+    bytecode_header header;
+    if (size < sizeof(header))
+    {
+        fprintf(stderr, "Error: %s is truncated\n", path);
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if (header.version != BYTECODE_VERSION)
+    {
+        fprintf(stderr, "Error: %s is bytecode version %u, this build reads version %u\n", path, header.version, BYTECODE_VERSION);
+        return false;
+    }
+
+    const uint64_t cell_size = header.cell_bits / 8;
+    const uint64_t available = size - sizeof(header);
+    if (header.instructions > available / sizeof(bytecode_instruction) ||
+        header.output_size > available - header.instructions * sizeof(bytecode_instruction) ||
+        header.tape_size != available - header.instructions * sizeof(bytecode_instruction) - header.output_size)
+    {
+        fprintf(stderr, "Error: %s is truncated\n", path);
+        return false;
+    }
+
+    const bool snapshot_valid = header.cell_bits == 0 ? !header.entry && !header.entry_cell && !header.output_size && !header.tape_size :
+                                (header.cell_bits == 8 || header.cell_bits == 16 || header.cell_bits == 32 || header.cell_bits == 64) &&
+                                header.entry < header.instructions && header.tape_size % cell_size == 0;
+
+    program.code.resize(header.instructions);
+    program.offsets.clear();
+    program.machine_code = { nullptr, 0 };
+
+    const char* at = data + sizeof(header);
+    for (instruction& ins : program.code)
+    {
+        bytecode_instruction record;
+        memcpy(&record, at, sizeof(record));
+        at += sizeof(record);
+        ins = { static_cast<op_code>(record.op), record.arg, record.offset };
+    }
+
+    // Snapshots only ever resume outside of loops (see evaluate_cells)
+    size_t depth = 0;
+    if (snapshot_valid && bytecode_valid(program.code))
+    {
+        for (size_t i = 0; i < header.entry; ++i)
+        {
+            if (program.code[i].op == OP_JZ)
+                ++depth;
+            else if (program.code[i].op == OP_JNZ)
+                --depth;
+        }
+    }
+
+    if (!snapshot_valid || depth || !bytecode_valid(program.code))
+    {
+        fprintf(stderr, "Error: %s is not valid bytecode\n", path);
+        program.code.clear();
+        return false;
+    }
+
+    program.cell_bits = header.cell_bits;
+    program.entry = header.entry;
+    program.entry_cell = header.entry_cell;
+    program.output.assign(at, at + header.output_size);
+    at += header.output_size;
+    program.tape.assign(at, at + header.tape_size);
+    program.checked = false;
+    for (const instruction& ins : program.code)
+    {
+        if (ins.op == OP_CHECK || ins.op == OP_CHECK_LOOP)
+            program.checked = true;
+    }
+    return true;
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <string>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "bf_source.hpp"
+
+// Bumped whenever the generated code changes in a way the key does not capture
+#define BF_CACHE_VERSION 1
+
+// 128-bit content hash of everything that affects the build: the program,
+// the flags, the backend and the build of bf_compiler itself
+struct cache_key
+{
+    uint64_t low, high;
+};
+
+inline void hash_bytes(cache_key& key, const void* data, const size_t size)
+{
+    // Two FNV-1a lanes with different primes, mixed once per byte
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        key.low = (key.low ^ bytes[i]) * 0x100000001B3ull;
+        key.high = (key.high ^ bytes[i] ^ (key.low >> 32)) * 0x1000000000000C5ull;
+    }
+}
+
+inline void hash_string(cache_key& key, const char* text)
+{
+    // The terminator keeps "ab"+"c" apart from "a"+"bc"
+    hash_bytes(key, text, strlen(text) + 1);
+}
+
+inline void init_cache_key(cache_key& key)
+{
+    key.low = 0xCBF29CE484222325ull;
+    key.high = 0x6C62272E07BB0142ull;
+
+    char version[64];
+    snprintf(version, sizeof(version), "%i %s %s", BF_CACHE_VERSION, __DATE__, __TIME__);
+    hash_string(key, version);
+}
+
+inline std::string cache_key_text(const cache_key& key)
+{
+    char text[33];
+    snprintf(text, sizeof(text), "%016llx%016llx", (unsigned long long)key.high, (unsigned long long)key.low);
+    return text;
+}
+
+// BF_CACHE_DIR if set, the per-user cache directory otherwise; empty when
+// there is nowhere to cache
+inline std::string cache_directory()
+{
+    const char* dir = getenv("BF_CACHE_DIR");
+    if (dir)
+        return dir;
+
+#ifdef _WIN32
+    if ((dir = getenv("LOCALAPPDATA")))
+        return std::string(dir) + "\\bf_compiler";
+#else
+    if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+        return std::string(dir) + "/bf_compiler";
+    if ((dir = getenv("HOME")) && *dir)
+        return std::string(dir) + "/.cache/bf_compiler";
+#endif
+    return std::string();
+}
+
+// mkdir -p
+inline bool make_directories(const std::string& path)
+{
+    for (size_t i = 1; i <= path.size(); ++i)
+    {
+        if (i < path.size() && path[i] != '/' && path[i] != '\\')
+            continue;
+
+        const std::string prefix = path.substr(0, i);
+#ifdef _WIN32
+        _mkdir(prefix.c_str());
+#else
+        mkdir(prefix.c_str(), 0755);
+#endif
+    }
+
+#ifdef _WIN32
+    const DWORD attributes = GetFileAttributesA(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+inline bool file_exists(const std::string& path)
+{
+#ifdef _WIN32
+    return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+    return access(path.c_str(), F_OK) == 0;
+#endif
+}
+
+// Copies from to to in one write, marking the copy executable if asked
+inline bool copy_file(const std::string& from, const std::string& to, const bool executable)
+{
+    source_file source;
+    if (!open_source(from.c_str(), source))
+        return false;
+
+    FILE* file = fopen(to.c_str(), "wb");
+    bool copied = file != nullptr;
+    if (file)
+    {
+        copied = fwrite(source.data, 1, source.size, file) == source.size;
+        copied = fclose(file) == 0 && copied;
+    }
+    close_source(source);
+
+#ifndef _WIN32
+    if (copied && executable)
+        chmod(to.c_str(), 0755);
+#else
+    (void)executable;
+#endif
+    return copied;
+}
+
+// Restores the cached file with the given extension to path, returns false
+// on a miss
+inline bool cache_fetch(const std::string& dir, const cache_key& key, const char* extension, const char* path, const bool executable)
+{
+    const std::string entry = dir + "/" + cache_key_text(key) + extension;
+    return file_exists(entry) && copy_file(entry, path, executable);
+}
+
+// Adds path to the cache under the given extension. The copy goes to a
+// private temporary name first and is renamed into place, so concurrent
+// builds never see a partial entry.
+inline bool cache_store(const std::string& dir, const cache_key& key, const char* extension, const char* path)
+{
+    if (!make_directories(dir))
+        return false;
+
+    // Unique across processes and across the threads of a -batch build
+    static std::atomic<unsigned> stores(0);
+    const std::string entry = dir + "/" + cache_key_text(key) + extension;
+#ifdef _WIN32
+    const std::string temporary = entry + ".tmp" + std::to_string(_getpid()) + "." + std::to_string(stores++);
+#else
+    const std::string temporary = entry + ".tmp" + std::to_string(getpid()) + "." + std::to_string(stores++);
+#endif
+
+    if (!copy_file(path, temporary, true))
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    const bool renamed = MoveFileExA(temporary.c_str(), entry.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    const bool renamed = rename(temporary.c_str(), entry.c_str()) == 0;
+#endif
+    if (!renamed)
+        remove(temporary.c_str());
+    return renamed;
+}
@@ -3,10 +3,28 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
 #include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
 
-#define MEMORY_SIZE 30000
-#define BUFFER_SIZE 1000000
+#include "bf_bytecode.hpp"
+#include "bf_cache.hpp"
+#include "bf_elf.hpp"
+#include "bf_io.hpp"
+#include "bf_ir.hpp"
+#include "bf_jit.hpp"
+#include "bf_lib.hpp"
+#include "bf_pool.hpp"
+#include "bf_profile.hpp"
+#include "bf_source.hpp"
+#include "bf_tape.hpp"
+#include "bf_writer.hpp"
+
+// Cells the -O2 partial evaluation may use, the rest of the tape is left to
+// the generated program
+#define EVAL_TAPE_SIZE 30000
 
 inline void substring(const char *inputString, int startPos, int length, char *outputString) 
 {
@@ -45,637 +63,756 @@ inline constexpr bool is_special(const char& chr)
     return false;
 }
 
-int main(int argc, const char *argv[]) 
+// Prints the I/O runtime every generated program that does I/O starts with:
+// bf_put/bf_write collect output and bf_flush hands it to stdout, bf_read
+// serves , from stdin read in large blocks, or from the file named by the
+// first argument (mapped when possible), and applies the EOF policy
+inline void print_io_runtime(text_writer &out, const size_t buffer_size, const eof_policy eof)
 {
-    /*
-        Flags in target program
-        -O[0-2] 0 does nothing, 1 enables code-logic optimizations, 2 enables compile-time evaluation
-        -Opf enables putchar to printf optimization (at least most of times optimization) (Only to be used with -O2)
-        -Oc[0-3, fast] specifies internal GCC's optimization flag for C code
-    */
+    write_format(out,
+        "#define _GNU_SOURCE\n"
+        "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n#include <fcntl.h>\n"
+        "#ifdef _WIN32\n#include <io.h>\n#else\n#include <unistd.h>\n#include <sys/mman.h>\n#include <sys/stat.h>\n#endif\n"
+        "static char bf_out[%zu];static size_t bf_out_len;"
+        "static void bf_flush(void){fwrite(bf_out,1,bf_out_len,stdout);fflush(stdout);bf_out_len=0;}"
+        "static inline void bf_put(char c){if(bf_out_len==sizeof bf_out)bf_flush();bf_out[bf_out_len++]=c;}"
+        "static inline void bf_write(const char*s,size_t n){if(n>sizeof bf_out-bf_out_len){bf_flush();if(n>sizeof bf_out){fwrite(s,1,n,stdout);return;}}memcpy(bf_out+bf_out_len,s,n);bf_out_len+=n;}\n"
+        "static unsigned char bf_in[%i];static const unsigned char*bf_in_pos,*bf_in_end;static int bf_in_fd=0;"
+        "static int bf_get(void){if(bf_in_pos==bf_in_end){if(bf_in_fd<0)return -1;bf_flush();long n=read(bf_in_fd,bf_in,sizeof bf_in);"
+        "if(n<=0){bf_in_fd=-1;return -1;}bf_in_pos=bf_in;bf_in_end=bf_in+n;}return*bf_in_pos++;}"
+        "static inline void bf_read(bf_cell*p){int c=bf_get();if(c>=0)*p=(bf_cell)c;%s}"
+        "static void bf_open_input(int argc,char**argv){if(argc<2)return;int fd=open(argv[1],O_RDONLY);if(fd<0){perror(argv[1]);exit(1);}\n"
+        "#ifndef _WIN32\n"
+        "struct stat st;if(!fstat(fd,&st)&&S_ISREG(st.st_mode)&&st.st_size>0){void*m=mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);"
+        "if(m!=MAP_FAILED){bf_in_pos=m;bf_in_end=bf_in_pos+st.st_size;bf_in_fd=-1;close(fd);return;}}\n"
+        "#endif\n"
+        "bf_in_fd=fd;}\n",
+        buffer_size ? buffer_size : 1, DEFAULT_INPUT_BUFFER_SIZE,
+        eof == EOF_ZERO ? "else *p=0;" : eof == EOF_MINUS_ONE ? "else *p=(bf_cell)-1;" : "");
+}
 
-    if (argc < 2) {
-        printf("Usage: %s {filename}.bf [-O[0-2], -Opf, -Oc[0-3, fast], -o {filename}.exe\n", argv[0]);
-        return 1;
+// Prints the typedef of bf_cell, the first line of every generated program:
+// char for 8-bit cells as always, unsigned types for wider ones so they wrap
+// around instead of overflowing
+inline void print_cell_type(text_writer &out, const unsigned cell_bits)
+{
+    write_format(out, "typedef %s bf_cell;\n", cell_bits == 16 ? "unsigned short" : cell_bits == 32 ? "unsigned int" :
+        cell_bits == 64 ? "unsigned long long" : "char");
+}
+
+// Prints the tape runtime, the C version of bf_tape.hpp: bf_tape_open reserves
+// tape_size cells between two guard regions and installs a fault handler that
+// commits more of the tape as the program reaches it, so the generated code
+// itself does not check bounds unless built with -checked
+inline void print_tape_runtime(text_writer &out, const size_t tape_size)
+{
+    write_format(out,
+        "#ifndef _GNU_SOURCE\n#define _GNU_SOURCE\n#endif\n"
+        "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n"
+        "#ifdef _WIN32\n#include <windows.h>\n#else\n#include <signal.h>\n#include <unistd.h>\n#include <sys/mman.h>\n#endif\n"
+        "#ifndef MAP_NORESERVE\n#define MAP_NORESERVE 0\n#endif\n"
+        "#define BF_GUARD %u\n"
+        "static char*bf_tape,*bf_tape_top,*bf_tape_end;static size_t bf_page;\n"
+        "__attribute__((noreturn))static void bf_tape_error(const char*m){\n"
+        "#ifdef _WIN32\nDWORD n;WriteFile(GetStdHandle(STD_ERROR_HANDLE),m,(DWORD)strlen(m),&n,0);ExitProcess(1);\n"
+        "#else\nif(write(2,m,strlen(m))){}_exit(1);\n#endif\n}\n"
+        "static int bf_commit(char*a){size_t used=bf_tape_top-bf_tape,want=((size_t)(a-bf_tape)/bf_page+1)*bf_page;"
+        "if(want<used*2)want=used*2;if(want>(size_t)(bf_tape_end-bf_tape))want=bf_tape_end-bf_tape;\n"
+        "#ifdef _WIN32\nif(!VirtualAlloc(bf_tape_top,want-used,MEM_COMMIT,PAGE_READWRITE))return 0;\n"
+        "#else\nif(mprotect(bf_tape_top,want-used,PROT_READ|PROT_WRITE))return 0;\n#endif\n"
+        "bf_tape_top=bf_tape+want;return 1;}\n"
+        "static int bf_tape_fault(char*a){if(a>=bf_tape_top&&a<bf_tape_end){if(bf_commit(a))return 1;bf_tape_error(\"Error: Out of memory growing the tape\\n\");}"
+        "if(a>=bf_tape-BF_GUARD&&a<bf_tape)bf_tape_error(\"Error: The program moved left of the first cell\\n\");"
+        "if(a>=bf_tape_end&&a<bf_tape_end+BF_GUARD)bf_tape_error(\"Error: The program ran past the end of the tape, give it a larger tape size\\n\");return 0;}\n"
+        "#ifdef _WIN32\n"
+        "static LONG WINAPI bf_fault(EXCEPTION_POINTERS*e){return e->ExceptionRecord->ExceptionCode==EXCEPTION_ACCESS_VIOLATION&&"
+        "bf_tape_fault((char*)e->ExceptionRecord->ExceptionInformation[1])?EXCEPTION_CONTINUE_EXECUTION:EXCEPTION_CONTINUE_SEARCH;}\n"
+        "#else\n"
+        "static void bf_fault(int s,siginfo_t*i,void*c){(void)s;(void)c;if(!bf_tape_fault(i->si_addr))signal(SIGSEGV,SIG_DFL);}\n"
+        "#endif\n"
+        "static char*bf_tape_open(void){size_t n=%zuu;\n"
+        "#ifdef _WIN32\n"
+        "SYSTEM_INFO si;GetSystemInfo(&si);bf_page=si.dwPageSize;n=(n+bf_page-1)/bf_page*bf_page;"
+        "char*m=VirtualAlloc(0,n+2*BF_GUARD,MEM_RESERVE,PAGE_NOACCESS);if(!m){fputs(\"Error: Cannot reserve the tape\\n\",stderr);exit(1);}"
+        "AddVectoredExceptionHandler(1,bf_fault);\n"
+        "#else\n"
+        "bf_page=sysconf(_SC_PAGESIZE);n=(n+bf_page-1)/bf_page*bf_page;"
+        "char*m=mmap(0,n+2*BF_GUARD,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);if(m==MAP_FAILED){perror(\"Error reserving the tape\");exit(1);}"
+        "struct sigaction a;memset(&a,0,sizeof a);a.sa_sigaction=bf_fault;a.sa_flags=SA_SIGINFO;sigemptyset(&a.sa_mask);sigaction(SIGSEGV,&a,0);\n"
+        "#endif\n"
+        "bf_tape=bf_tape_top=m+BF_GUARD;bf_tape_end=bf_tape+n;"
+        "if(!bf_commit(bf_tape+(n<%uu?n:%uu)-1)){fputs(\"Error: Cannot commit the tape\\n\",stderr);exit(1);}return bf_tape;}\n",
+        TAPE_GUARD_SIZE, tape_size, TAPE_INITIAL_COMMIT, TAPE_INITIAL_COMMIT);
+}
+
+// Prints bf_check for -checked, the C version of check_cells: ends the program
+// unless p[low] through p[high] are all on the tape. It compares against
+// bf_base and bf_cells, locals of main that cell stores cannot alias, and
+// failures go to a cold function, so a check costs two compares in the
+// program's own registers.
+inline void print_check_runtime(text_writer &out)
+{
+    write_text(out,
+        "__attribute__((cold,noreturn))static void bf_bounds(int left){"
+        "bf_tape_error(left?\"Error: The program moved left of the first cell\\n\":"
+        "\"Error: The program ran past the end of the tape, give it a larger tape size\\n\");}\n"
+        "#define bf_check(p,low,high) do{if(__builtin_expect((unsigned long long)((p)-bf_base+(low))>=bf_cells||"
+        "(unsigned long long)((p)-bf_base+(high))>=bf_cells,0))bf_bounds((p)-bf_base+(low)<0);}while(0)\n");
+}
+
+// Prints output known at compile time as one bf_write call and empties it
+inline void print_constant_output(text_writer &out, std::vector<char> &output)
+{
+    if (output.empty())
+        return;
+
+    write_text(out, "bf_write(\"");
+    for (const char chr : output)
+    {
+        if (is_special(chr))
+            write_format(out, "\\%c", special_to_escaped(chr));
+        else if (chr == '?')
+            write_text(out, "\\?"); // Keeps trigraphs out of the literal
+        else if ((unsigned char)chr < ' ' || (unsigned char)chr >= 127)
+            write_format(out, "\\%03o", (unsigned char)chr);
+        else
+            write_char(out, chr);
     }
+    write_format(out, "\",%zu);", output.size());
+    output.clear();
+}
 
-    const char *input_filename = argv[1];
-    char output_filename[256] = "out.exe", c_output_filename[256] = "out.c";
-    bool printf_optimized = false;
-    uint8_t optimization_level = 0;
-    char c_optimized[5] = {0};
+// Prints the C versions of the scan kernels in bf_scan.hpp that the program
+// uses, right and/or left. Most scans stop within a few cells, so
+// bf_scan_right/bf_scan_left test the first BF_SCAN_INLINE cells inline like
+// the plain loop would and only then call the search: memchr/memrchr for
+// stride 1, an SSE2/AVX2 compare-and-mask for strides up to the vector width.
+// Like scan_cells, they end the program if the scan runs off the tape.
+inline void print_scan_runtime(text_writer &out, const bool right, const bool left)
+{
+    write_text(out,
+        "#include <string.h>\n"
+        "#include <stdint.h>\n"
+        "#define BF_SCAN_INLINE 4\n"
+        "#if defined(__AVX2__)\n"
+        "#include <immintrin.h>\n"
+        "#define BF_LANES 32\n"
+        "static inline uint32_t bf_zero_mask(const char*p){return(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p),_mm256_setzero_si256()));}\n"
+        "#elif defined(__SSE2__)\n"
+        "#include <emmintrin.h>\n"
+        "#define BF_LANES 16\n"
+        "static inline uint32_t bf_zero_mask(const char*p){return(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p),_mm_setzero_si128()));}\n"
+        "#endif\n");
 
-    // Parse command-line arguments
-    for (int i = 1; i < argc - 1; i++) 
+    if (right)
+        write_text(out,
+            "static char*bf_search_right(char*p,int s,char*end){\n"
+            "if(s==1){char*f=p<end?memchr(p,0,end-p):0;\nif(f)\nreturn f;\np=end;}\n"
+            "#ifdef BF_LANES\n"
+            "if(s<=BF_LANES){uint32_t m=0;\nfor(int i=0;i<BF_LANES;i+=s)\nm|=1u<<i;\nint step=BF_LANES-BF_LANES%s;\n"
+            "for(;end-p>=BF_LANES;p+=step){uint32_t z=bf_zero_mask(p)&m;\nif(z)\nreturn p+__builtin_ctz(z);\n}}\n"
+            "#endif\n"
+            "while(p<end&&*p)\np+=s;\n"
+            "if(p>=end)\nbf_tape_error(\"Error: The program ran past the end of the tape, give it a larger tape size\\n\");\n"
+            "return p;}\n"
+            "static inline char*bf_scan_right(char*p,int s,char*end){\n"
+            "for(int i=0;i<BF_SCAN_INLINE;i++,p+=s)\nif(!*p)\nreturn p;\n"
+            "return bf_search_right(p,s,end);}\n");
+
+    if (left)
+        write_text(out,
+            "static char*bf_search_left(char*p,int s,char*begin){\n"
+            "#ifdef __GLIBC__\n"
+            "if(s==1){char*f=p>=begin?memrchr(begin,0,p-begin+1):0;\nif(f)\nreturn f;\np=begin-1;}\n"
+            "#endif\n"
+            "#ifdef BF_LANES\n"
+            "if(s<=BF_LANES){uint32_t m=0;\nfor(int i=BF_LANES-1;i>=0;i-=s)\nm|=1u<<i;\nint step=BF_LANES-BF_LANES%s;\n"
+            "for(;p-begin>=BF_LANES-1;p-=step){char*w=p-(BF_LANES-1);uint32_t z=bf_zero_mask(w)&m;\nif(z)\nreturn w+31-__builtin_clz(z);\n}}\n"
+            "#endif\n"
+            "while(p>=begin&&*p)\np-=s;\n"
+            "if(p<begin)\nbf_tape_error(\"Error: The program moved left of the first cell\\n\");\n"
+            "return p;}\n"
+            "static inline char*bf_scan_left(char*p,int s,char*begin){\n"
+            "for(int i=0;i<BF_SCAN_INLINE;i++,p-=s)\nif(!*p)\nreturn p;\n"
+            "return bf_search_left(p,s,begin);}\n");
+}
+
+// Prints value as a bf_cell constant, wrapped to the cell width the way a
+// store wraps it. Known values are exact sums (see cell_value), so 300 + on a
+// cleared 8-bit cell is printed as 44.
+inline void print_cell_value(text_writer &out, const unsigned cell_bits, const int64_t value)
+{
+    if (cell_bits == 8)
+        write_int(out, (signed char)value);
+    else
+    {
+        write_format(out, "%llu", (unsigned long long)(cell_bits == 64 ? (uint64_t)value : (uint64_t)value & ((1ull << cell_bits) - 1)));
+        write_char(out, 'u');
+    }
+}
+
+// Prints ++target;, target+=n; and so on, nothing for 0
+inline void print_adjust(text_writer &out, const char *target, const int32_t value)
+{
+    if (!value)
+        return;
+
+    if (value == 1 || value == -1)
+    {
+        write_text(out, value > 0 ? "++" : "--");
+        write_text(out, target);
+    }
+    else
     {
-        if (strcmp(argv[i], "-o") == 0) 
+        write_text(out, target);
+        write_text(out, value > 0 ? "+=" : "-=");
+        write_int(out, value > 0 ? (int64_t)value : -(int64_t)value);
+    }
+    write_char(out, ';');
+}
+
+// How a loop is printed, decided from a profile by plan_loops
+struct loop_plan
+{
+    int8_t expect;      // -1 no hint, otherwise the likely value of *ptr!=0 at the loop test
+    uint8_t unroll;     // #pragma GCC unroll factor, 0 for none
+    bool peel;          // print the first iteration separately, for loops that mostly run once
+};
+
+#define PGO_UNROLL_MIN_TRIP 4
+#define PGO_UNROLL_MAX 8
+#define PGO_PEEL_MIN_TRIP 0.5
+#define PGO_PEEL_MAX_TRIP 1.5
+#define PGO_PEEL_MAX_SIZE 32
+
+// Turns observed entry and iteration counts into a plan for every loop:
+// loops that are mostly skipped are marked unlikely, loops that mostly run
+// once get their first iteration peeled, and loops that repeat are marked
+// likely, innermost ones with long trips also unrolled
+inline void plan_loops(const std::vector<instruction> &program, const std::vector<loop_counts> &counts, std::vector<loop_plan> &plans)
+{
+    plans.assign(program.size(), loop_plan{ -1, 0, false });
+
+    for (size_t i = 0; i < program.size(); i++)
+    {
+        if (program[i].op != OP_JZ || !counts[i].known || !counts[i].entries)
+            continue;
+
+        const size_t close = (size_t)program[i].arg;
+        const double trip = (double)counts[i].iterations / (double)counts[i].entries;
+        const bool innermost = std::none_of(program.begin() + i + 1, program.begin() + close, [](const instruction &ins) { return ins.op == OP_JZ; });
+        loop_plan &plan = plans[i];
+
+        if (trip < PGO_PEEL_MIN_TRIP)
+            plan.expect = 0;
+        else if (trip < PGO_PEEL_MAX_TRIP)
         {
-            strcpy(output_filename, argv[i + 1]);
-            // Copy the output filename without the .exe extension
-            strcpy(c_output_filename, argv[i + 1]); // Copy the output filename without the .exe extension
-            char* dot;
-            if ((dot = std::find(c_output_filename, c_output_filename + 256, '.')) != c_output_filename + 256) {
-                *dot = '\0'; // Null-terminate the string at the position of the last '.'
-            }
-            strcat(c_output_filename, ".c"); // Append ".c" extension
+            // Once the peeled iteration ran, another one is unlikely
+            plan.peel = close - i <= PGO_PEEL_MAX_SIZE;
+            plan.expect = plan.peel ? 0 : -1;
         }
-        else if (strncmp(argv[i], "-Oc", 3) == 0)
+        else
         {
-            substring(argv[i], 3, 5, c_optimized);
+            plan.expect = 1;
+            if (innermost && trip >= PGO_UNROLL_MIN_TRIP)
+                for (plan.unroll = 2; plan.unroll < PGO_UNROLL_MAX && plan.unroll * 2 <= trip; plan.unroll *= 2)
+                    ;
         }
-        else if (strcmp(argv[i], "-Opf") == 0)
+    }
+}
+
+inline void print_loop_test(text_writer &out, const char *cell, const int8_t expect)
+{
+    if (expect < 0)
+    {
+        write_text(out, "while(");
+        write_text(out, cell);
+        write_text(out, "){");
+    }
+    else
+        write_format(out, "while(__builtin_expect(%s!=0,%i)){", cell, expect);
+}
+
+// Sets cell to how the cell shift ahead of ptr is addressed
+inline void format_cell(char (&cell)[32], const int32_t shift)
+{
+    if (shift)
+        snprintf(cell, sizeof(cell), "ptr[%i]", shift);
+    else
+        strcpy(cell, "*ptr");
+}
+
+// Prints the C statements for program[begin, end), with loops shaped by the
+// profile if plans is given. Moves are not printed as they come: shift is how
+// far the brainfuck pointer is ahead of ptr, cells are addressed as
+// ptr[shift], and ptr only catches up at scans and around loops that are not
+// balanced. Balanced loops test ptr[shift] and keep it. Returns the
+// shift at end.
+inline int32_t print_range(text_writer &out, const std::vector<instruction> &program, const unsigned cell_bits, const size_t begin,
+                            const size_t end, const std::vector<loop_plan> *plans,
+                            const std::vector<bool> &balanced, int32_t shift)
+{
+    char cell[32];
+    int32_t cell_shift = shift;
+    format_cell(cell, shift);
+
+    for (size_t i = begin; i < end; i++)
+    {
+        const instruction &ins = program[i];
+
+        if (shift != cell_shift)
         {
-            printf_optimized = true;
+            cell_shift = shift;
+            format_cell(cell, shift);
         }
-        else if (strncmp(argv[i], "-O", 2) == 0)
+
+        switch (ins.op)
         {
-            optimization_level = argv[i][2] - '0';
+            case OP_ADD:
+                print_adjust(out, cell, ins.arg);
+                break;
+            case OP_MOVE:
+                shift += ins.arg;
+                break;
+            case OP_OUT:
+                write_text(out, "bf_put(");
+                write_text(out, cell);
+                write_text(out, ");");
+                break;
+            case OP_IN:
+                if (shift)
+                    write_format(out, "bf_read(&%s);", cell);
+                else
+                    write_text(out, "bf_read(ptr);");
+                break;
+            case OP_JZ:
+            {
+                const size_t close = (size_t)ins.arg;
+                const loop_plan plan = plans ? (*plans)[i] : loop_plan{ -1, 0, false };
+
+                if (!balanced[i])
+                {
+                    print_adjust(out, "ptr", shift);
+                    shift = cell_shift = 0;
+                    format_cell(cell, 0);
+                }
+
+                if (plan.peel)
+                {
+                    write_format(out, "if(__builtin_expect(%s!=0,1)){", cell);
+                    print_adjust(out, "ptr", print_range(out, program, cell_bits, i + 1, close, plans, balanced, shift) - shift);
+                    print_loop_test(out, cell, 0);
+                    print_adjust(out, "ptr", print_range(out, program, cell_bits, i + 1, close, plans, balanced, shift) - shift);
+                    write_text(out, "}}");
+                }
+                else
+                {
+                    if (plan.unroll)
+                        write_format(out, "\n#pragma GCC unroll %i\n", plan.unroll);
+                    print_loop_test(out, cell, plan.expect);
+                    print_adjust(out, "ptr", print_range(out, program, cell_bits, i + 1, close, plans, balanced, shift) - shift);
+                    write_text(out, "}");
+                }
+                i = close;
+                break;
+            }
+            case OP_JNZ:
+                write_text(out, "}");
+                break;
+            case OP_CLEAR:
+                write_text(out, cell);
+                write_text(out, "=0;");
+                break;
+            case OP_SET:
+                write_text(out, cell);
+                write_char(out, '=');
+                print_cell_value(out, cell_bits, ins.arg);
+                write_char(out, ';');
+                break;
+            case OP_PUT:
+            {
+                // Runs of known output become one bf_write
+                std::vector<char> text(1, (char)ins.arg);
+                for (; i + 1 < end && program[i + 1].op == OP_PUT; i++)
+                    text.push_back((char)program[i + 1].arg);
+                print_constant_output(out, text);
+                break;
+            }
+            case OP_MUL:
+                // The loop's test stays around its products and the clear.
+                // Without it gcc keeps the cells in registers into the loop
+                // that follows and reloads them with wider accesses that
+                // stall on the byte stores, rot13 ran slower at -O1 than -O0.
+                if (i == begin || program[i - 1].op != OP_MUL)
+                    write_format(out, "if(%s){", cell);
+
+                // 16-bit cells promote to int, where the product could overflow
+                write_text(out, "ptr[");
+                write_int(out, (int64_t)shift + ins.offset);
+                write_text(out, "]+=");
+                write_text(out, cell);
+                if (ins.arg != 1)
+                {
+                    write_char(out, '*');
+                    write_int(out, cell_bits == 16 ? (int64_t)(uint32_t)ins.arg : ins.arg);
+                    if (cell_bits == 16)
+                        write_char(out, 'u');
+                }
+                write_char(out, ';');
+
+                if (i + 1 < end && program[i + 1].op == OP_MUL)
+                    break;
+                if (i + 1 < end && program[i + 1].op == OP_CLEAR)
+                {
+                    write_text(out, cell);
+                    write_text(out, "=0;");
+                    i++;
+                }
+                write_char(out, '}');
+                break;
+            case OP_SCAN:
+                print_adjust(out, "ptr", shift);
+                shift = 0;
+
+                // The vector kernels work on bytes, wider cells get the plain loop
+                if (cell_bits != 8)
+                {
+                    write_text(out, "while(*ptr){");
+                    print_adjust(out, "ptr", ins.arg);
+                    write_text(out, "}");
+                }
+                else if (ins.arg > 0)
+                    write_format(out, "ptr=bf_scan_right(ptr,%i,bf_tape_end);", ins.arg);
+                else
+                    write_format(out, "ptr=bf_scan_left(ptr,%i,bf_tape);", -ins.arg);
+                break;
+            case OP_CHECK:
+            case OP_CHECK_LOOP:
+                if (ins.op == OP_CHECK_LOOP)
+                    write_format(out, "if(%s)", cell);
+                write_format(out, "bf_check(ptr,%lld,%lld);", (long long)shift + ins.arg, (long long)shift + ins.offset);
+                break;
+            case OP_END:
+                break;
         }
     }
-    
-    printf("Optimization: %i\n", optimization_level);
+    return shift;
+}
 
-    FILE *file = fopen(input_filename, "r"); // Open the input file in read mode
-    if (file == NULL) {
-        perror("Error opening input file");
-        return 1;
-    }
+// Prints the C statements for the instruction stream from begin on
+inline void print_program(text_writer &out, const std::vector<instruction> &program, const unsigned cell_bits, const size_t begin = 0,
+                           const std::vector<loop_plan> *plans = nullptr)
+{
+    std::vector<bool> balanced;
+    find_balanced_loops(program, balanced);
+    print_range(out, program, cell_bits, begin, program.size(), plans, balanced, 0);
+}
 
-    // Allocate memory for a buffer
-    char buffer[BUFFER_SIZE];
-    uint64_t bytesRead;
+// Everything the command line sets besides the file names
+struct compile_options
+{
+    uint8_t optimization_level = 0;
+    char c_optimized[6] = {0};
+    bool jit = false, elf = false, bytecode = false, checked = false, use_cache = true;
+    size_t output_buffer_size = DEFAULT_OUTPUT_BUFFER_SIZE;
+    eof_policy eof = EOF_MINUS_ONE;
+    size_t tape_size = DEFAULT_TAPE_SIZE;
+    unsigned cell_bits = 8;
+    const char *input_path = NULL;
+    uint64_t eval_steps = 100000000;
+    uint32_t eval_ms = 0;
+    const char *profile_path = NULL;
+};
 
-    // Read the file into the buffer
-    bytesRead = fread(buffer, sizeof(char), BUFFER_SIZE, file);
-    if (!bytesRead) {
-        perror("Error reading input file");
-        fclose(file);
-        return 1;
-    }
-    // Close the input file
-    fclose(file);  
+// path as one word of a system() command line, whatever characters it holds,
+// and never taken for an option
+inline std::string shell_quote(const char *path)
+{
+    const std::string word = path[0] == '-' ? std::string("./") + path : std::string(path);
+#ifdef _WIN32
+    return "\"" + word + "\"";
+#else
+    std::string quoted = "'";
+    for (const char chr : word)
+        quoted += chr == '\'' ? std::string("'\\''") : std::string(1, chr);
+    return quoted + "'";
+#endif
+}
+
+// Runs as much of the program as possible right now, for -O2
+void evaluate_ahead(const compile_options &options, const std::vector<instruction> &program, evaluation_state &state, FILE *log)
+{
+    partial_evaluate(program, options.cell_bits, std::min<size_t>(options.tape_size / (options.cell_bits / 8), EVAL_TAPE_SIZE), options.eval_steps, options.eval_ms, state);
+
+    if (state.finished)
+        fprintf(log, "Evaluated the whole program at compile time (%llu steps)\n", (unsigned long long)state.steps);
+    else
+        fprintf(log, "Evaluated %llu steps at compile time, resuming at instruction %zu\n", (unsigned long long)state.steps, state.pc);
+}
 
-    // Create new file for C output
-    FILE *outFile = fopen(c_output_filename, "w");
+// Builds (or, with -jit, runs) one program, progress messages go to log
+int compile_file(const compile_options &options, const char *input_filename, const char *output_filename, const char *c_output_filename, FILE *log)
+{
+    const uint8_t optimization_level = options.optimization_level;
+    const char *c_optimized = options.c_optimized;
+    const bool jit = options.jit, elf = options.elf, bytecode = options.bytecode;
+    const size_t output_buffer_size = options.output_buffer_size;
+    const eof_policy eof = options.eof;
+
+    // Map the input file ("-" reads the program from stdin)
+    source_file source;
+    if (!open_source(input_filename, source))
+        return 1;
 
-    // Check if output file opened successfully
-    if (!outFile) {
-        perror("Error creating output file");
+    if (!source.size) {
+        fprintf(stderr, "Error reading input file: %s is empty\n", input_filename);
+        close_source(source);
         return 1;
     }
 
-    buffer[bytesRead] = '\0';
-    char *buf_ptr = buffer - 1;
+    // Everything below reads the program straight from the mapping
+    const char *buffer = source.data;
 
-    bool printf_printed = false;
-    char printf_args[500000] = {0}; 
-    int index_pa = 0;
+    // '@' marks the end of the program, everything after it is ignored
+    const char *end_marker = (const char *)memchr(buffer, '@', source.size);
+    const size_t program_length = end_marker ? end_marker - buffer : source.size;
 
-    if (optimization_level == 2)
+    // Identical builds are served from the cache: the key covers the program
+    // and every flag that changes the executable
+    const std::string cache_dir = options.use_cache && !jit ? cache_directory() : std::string();
+    cache_key key;
+    if (!cache_dir.empty())
     {
-        // Print the C code onto the file
+        char flags[256];
+        snprintf(flags, sizeof(flags), "%s -O%i -Oc%s -buffer-size=%zu -eof=%i -eval-steps=%llu -eval-ms=%u -tape-size=%zu -cell-bits=%u%s",
+            elf ? "elf" : bytecode ? "bytecode" : "c", optimization_level, c_optimized, output_buffer_size, (int)eof,
+            (unsigned long long)options.eval_steps, options.eval_ms, options.tape_size, options.cell_bits, options.checked ? " -checked" : "");
+
+        init_cache_key(key);
+        hash_string(key, flags);
+        hash_bytes(key, buffer, program_length);
 
-        bool found_comma = false, found_dot = false;
-        
-        while (*++buf_ptr)
+        // A new profile of the same program is a different build
+        source_file profile;
+        if (options.profile_path && open_source(options.profile_path, profile)) {
+            hash_bytes(key, profile.data, profile.size);
+            close_source(profile);
+        }
+
+        if (cache_fetch(cache_dir, key, bytecode ? ".bfc" : ".exe", output_filename, !bytecode) &&
+            (elf || bytecode || cache_fetch(cache_dir, key, ".c", c_output_filename, false)))
         {
-            switch (*buf_ptr)
-            {
-                case ',':
-                    found_comma = true;
-                    break;
-                case '.':
-                    found_dot = true;
-                    break;
-                default:
-                    break;
-            }
+            close_source(source);
+            fprintf(log, "Cache hit (%s). Output %s: %s\n", cache_key_text(key).c_str(), bytecode ? "bytecode" : "executable", output_filename);
+            return 0;
         }
-        buf_ptr = buffer;
+    }
 
-        if (found_dot || found_comma)
-            fprintf(outFile, "#include <stdio.h>\n");
+    // Every backend works on the instruction stream, parsed once. The JIT,
+    // the ELF backend, bytecode, -O1 and -O2 also have loop idioms turned
+    // into dedicated instructions and known values folded; -O0 prints the
+    // program as it was parsed.
+    bf_program compiled;
+    const std::vector<instruction> &program = compiled.code;
+    const std::vector<uint32_t> &offsets = compiled.offsets;
+    const bool profile_guided = options.profile_path && !jit && !elf && !bytecode && optimization_level >= 1;
+    const bool parsed = jit || elf || bytecode || optimization_level >= 1 ?
+        bf_compile(buffer, program_length, compiled, (profile_guided ? BF_KEEP_OFFSETS : 0) | (jit ? BF_COMPILE_JIT : 0)) :
+        parse_program(buffer, program_length, compiled.code);
+    if (!parsed) {
+        close_source(source);
+        return 1;
+    }
 
-        fprintf(outFile, "int main(){");
+    // Loop hotness and trip counts from a bf_interpreter --write-profile run
+    // shape the generated loops; a profile that does not fit is ignored
+    std::vector<loop_plan> plans;
+    std::vector<loop_counts> counts;
+    if (options.profile_path && !profile_guided)
+        fprintf(stderr, "Warning: -fprofile-use only applies to the C backends at -O1 and -O2\n");
+    else if (profile_guided && read_loop_profile(options.profile_path, program, offsets, counts))
+        plan_loops(program, counts, plans);
+    const std::vector<loop_plan> *loop_plans = plans.empty() ? NULL : &plans;
 
-        if (found_comma)
-        {
-            fprintf(outFile, "char array[");
-            fprintf(outFile, "%li", MEMORY_SIZE);
-            fprintf(outFile, "]={0},*ptr=array;");
-        }
-        char array[MEMORY_SIZE] = {0};
-        int32_t array_ptr_diff = 0, loop_stack_ptr = -1;
-        bool not_constant_value[MEMORY_SIZE] = {false};
+    if (jit)
+    {
+#ifdef BF_JIT_SUPPORTED
+        close_source(source);
 
-        if (found_dot)
-        {
-            int32_t loop_stack[MEMORY_SIZE];
-            int32_t array_ptr = 0;
-            buf_ptr = buffer;
+        // The generated code does not check bounds either, the tape's fault
+        // handler grows it
+        bf_instance_options instance_options;
+        instance_options.tape_size = options.tape_size;
+        instance_options.output_buffer_size = output_buffer_size;
+        instance_options.eof = eof;
+        instance_options.input_path = options.input_path;
 
-            while (*++buf_ptr)
-            {
-                switch (*buf_ptr)
-                {
-                    case '>':
-                        ++array_ptr;
-                        break;
-                    case '<':
-                        --array_ptr;
-                        break;
-                    case '+':
-                        ++array[array_ptr];
-                        break;
-                    case '-':
-                        --array[array_ptr];
-                        break;
-                    case '.':
-                        if (printf_optimized)
-                        {
-                            if (!printf_printed)
-                            {
-                                fprintf(outFile, "printf(\"");
-                                printf_printed = true;
-                            }
-                            if (!not_constant_value[array_ptr])
-                            {
-                                // NULL character handling
-                                if (!array[array_ptr])
-                                {
-                                    fprintf(outFile, "%%c");
-                                    snprintf(printf_args + index_pa, sizeof(printf_args) - index_pa, ",0");
-                                    index_pa += 2;
-                                }
-                                // percent character handling
-                                else if (array[array_ptr] == '%')
-                                    fprintf(outFile, "%%%%");
-                                // other special characters handling
-                                else if (is_special(array[array_ptr]))
-                                    fprintf(outFile, "\\%c", special_to_escaped(array[array_ptr]));
-                                // characters that don't need to be escaped in any way
-                                else
-                                    fprintf(outFile, "%c", array[array_ptr]);
-                            }
-                            else
-                            {
-                                fprintf(outFile, "%%c");
-                                snprintf(printf_args + index_pa, sizeof(printf_args) - index_pa, ",*(ptr+%i)+=%i", array_ptr, array[array_ptr]);
-                                index_pa += 10;
-                                char num_str[20];
-                                ltoa(array_ptr, num_str, 10);
-                                index_pa += strlen(num_str);
-                                memset(num_str, 0, 20);
-                                ltoa(array[array_ptr], num_str, 10);
-                                index_pa += strlen(num_str);
-                                array[array_ptr] = 0; // Reset the value
-                            }
-                        }
-                        else
-                        {
-                            if (!not_constant_value[array_ptr])
-                                fprintf(outFile, "putchar(%i);", array[array_ptr]);
-                            else {
-                                fprintf(outFile, "putchar(*(ptr+%i)+=%i);", array_ptr, array[array_ptr]);
-                                array[array_ptr] = 0; // Reset the value
-                            }
-                        }
-                        break;
-                    case ',':
-                        not_constant_value[array_ptr] = true;
-                        if (printf_optimized && printf_printed)
-                        {
-                            fprintf(outFile, "\"%s);*(ptr+%i)=getchar();", printf_args, array_ptr);
-                            index_pa = 0;
-                            memset(printf_args, 0, sizeof(printf_args));
-                            printf_printed = false;
-                        }
-                        else
-                            fprintf(outFile, "*(ptr+%i)=getchar();", array_ptr);
-                        break;
-                    case '[':
-                        if (!array[array_ptr]) 
-                        {
-                            // Jump to matching ']'
-                            int loop_count = 1;
-                            while (loop_count) 
-                            {
-                                if (*++buf_ptr == '[') ++loop_count;
-                                else if (*buf_ptr == ']') --loop_count;
-                            }
-                        } 
-                        else
-                            loop_stack[++loop_stack_ptr] = buf_ptr - buffer; // Push position of '[' onto loop stack
-                        break;
-                    case ']':
-                        if (array[array_ptr]) 
-                            buf_ptr = buffer + loop_stack[loop_stack_ptr]; // Jump back to corresponding '['
-                        else
-                            --loop_stack_ptr; // Pop from loop stack
-                        break;
-                    case '@':
-                        goto exitwhile;
-                        break;
-                    default:
-                        break;
-                }
-            }
-            exitwhile:
-            if (printf_optimized)
-                fprintf(outFile, "\"%s);", printf_args);
+        bf_instance instance;
+        if (!bf_open_instance(instance, instance_options)) {
+            bf_free_program(compiled);
+            return 1;
         }
+
+        const bf_status status = bf_run(instance, compiled);
+        bf_close_instance(instance);
+        bf_free_program(compiled);
+        return status == BF_FINISHED ? 0 : 1;
+#else
+        fprintf(stderr, "Error: -jit is only supported on x86-64\n");
+        return 1;
+#endif
     }
-    else if (optimization_level == 1)
+
+    if (bytecode)
     {
-        // Print the C code onto the file
-        char array[MEMORY_SIZE] = {0};
-        int array_ptr = 0, array_ptr_diff = 0;
+        // With -O2 the file also keeps how far compile-time evaluation got,
+        // runs pick up from there
+        evaluation_state state;
+        if (optimization_level == 2)
+            evaluate_ahead(options, program, state, log);
+        if (options.checked)
+            state.pc = insert_bounds_checks(compiled.code, NULL, optimization_level == 2 && !state.finished ? state.pc : SIZE_MAX);
 
+        const bool written = bytecode_write(output_filename, program, options.cell_bits, optimization_level == 2 ? &state : NULL);
+        close_source(source);
+        if (!written)
+            return 1;
+        if (!cache_dir.empty())
+            cache_store(cache_dir, key, ".bfc", output_filename);
+        fprintf(log, "Output bytecode: %s\n", output_filename);
+        return 0;
+    }
 
+    if (elf)
+    {
+        const bool written = elf_write(output_filename, program, output_buffer_size, eof, options.tape_size);
+        close_source(source);
+        if (!written)
+            return 1;
+        if (!cache_dir.empty())
+            cache_store(cache_dir, key, ".exe", output_filename);
+        fprintf(log, "Output executable: %s\n", output_filename);
+        return 0;
+    }
+
+    fprintf(log, "Optimization: %i\n", optimization_level);
 
-        fprintf(outFile, "#include <stdio.h>\nint main(){");
-        fprintf(outFile, "char array[");
-        fprintf(outFile, "%li", MEMORY_SIZE);
-        fprintf(outFile, "]={0},*ptr=array;");
+    // With -O2, run as much of the program as possible right now: the output
+    // it produced, the tape it left behind and the rest of the program
+    // resuming from where the evaluation stopped are all that get printed
+    evaluation_state state;
+    state.finished = false;
+    state.ptr = 0;
+    state.pc = 0;
+    size_t resume = SIZE_MAX;
+    if (optimization_level == 2)
+    {
+        evaluate_ahead(options, program, state, log);
+        resume = state.pc;
+    }
 
-        while (*++buf_ptr)
+    // Checks go in after evaluation, which has its own, and after the
+    // profile was matched against the program without them
+    if (options.checked)
+    {
+        std::vector<size_t> moved;
+        resume = insert_bounds_checks(compiled.code, NULL, resume, loop_plans ? &moved : NULL);
+        if (loop_plans)
         {
-            if (buf_ptr + 2 < buffer + bytesRead && *buf_ptr == '[' && (*(buf_ptr + 1) == '+' || *(buf_ptr + 1) == '-') && *buf_ptr == ']')
-            {
-                fprintf(outFile, "*ptr=0;");
-                buf_ptr += 3;
-            }
-            switch (*buf_ptr)
-            {
-                // Handling BF statements
-                case '>':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    if (array[array_ptr])
-                    {
-                        if (array[array_ptr] > 1)
-                            fprintf(outFile, "*ptr+=%i;", array[array_ptr]);
-                        else if (array[array_ptr] == 1)
-                            fprintf(outFile, "++*ptr;");
-                        else if (array[array_ptr] == -1)
-                            fprintf(outFile, "--*ptr;");
-                        else
-                            fprintf(outFile, "*ptr-=%i;", -array[array_ptr]);
-                        array[array_ptr] = 0;
-                    }
-                    ++array_ptr;
-                    ++array_ptr_diff;
-                    break;
-                case '<':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    if (array[array_ptr])
-                    {
-                        if (array[array_ptr] > 1)
-                            fprintf(outFile, "*ptr+=%i;", array[array_ptr]);
-                        else if (array[array_ptr] == 1)
-                            fprintf(outFile, "++*ptr;");
-                        else if (array[array_ptr] == -1)
-                            fprintf(outFile, "--*ptr;");
-                        else
-                            fprintf(outFile, "*ptr-=%i;", -array[array_ptr]);
-                        array[array_ptr] = 0;
-                    }
-                    --array_ptr;
-                    --array_ptr_diff;
-                    break;
-                case '+':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    if (array_ptr_diff)
-                    {
-                        if (array_ptr_diff > 1)
-                            fprintf(outFile, "ptr+=%i;", array_ptr_diff);
-                        else if (array_ptr_diff == 1)
-                            fprintf(outFile, "++ptr;");
-                        else if (array_ptr_diff == -1)
-                            fprintf(outFile, "--ptr;");
-                        else
-                            fprintf(outFile, "ptr-=%i;", -array_ptr_diff);
-                        array_ptr_diff = 0;
-                    }
-                    //fprintf(outFile, "++*ptr;");
-                    ++array[array_ptr];
-                    break;
-                case '-':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    if (array_ptr_diff)
-                    {
-                        if (array_ptr_diff > 1)
-                            fprintf(outFile, "ptr+=%i;", array_ptr_diff);
-                        else if (array_ptr_diff == 1)
-                            fprintf(outFile, "++ptr;");
-                        else if (array_ptr_diff == -1)
-                            fprintf(outFile, "--ptr;");
-                        else
-                            fprintf(outFile, "ptr-=%i;", -array_ptr_diff);
-                        array_ptr_diff = 0;
-                    }
-                    //fprintf(outFile, "--*ptr;");
-                    --array[array_ptr];
-                    break;
-                case '.':                    
-                    if (array_ptr_diff)
-                    {
-                        if (array_ptr_diff > 1)
-                            fprintf(outFile, "ptr+=%i;", array_ptr_diff);
-                        else if (array_ptr_diff == 1)
-                            fprintf(outFile, "++ptr;");
-                        else if (array_ptr_diff == -1)
-                            fprintf(outFile, "--ptr;");
-                        else
-                            fprintf(outFile, "ptr-=%i;", -array_ptr_diff);
-                        array_ptr_diff = 0;
-                    }
-                    if (array[array_ptr])
-                    {
-                        if (array[array_ptr] > 1)
-                            fprintf(outFile, "*ptr+=%i;", array[array_ptr]);
-                        else if (array[array_ptr] == 1)
-                            fprintf(outFile, "++*ptr;");
-                        else if (array[array_ptr] == -1)
-                            fprintf(outFile, "--*ptr;");
-                        else
-                            fprintf(outFile, "*ptr-=%i;", -array[array_ptr]);
-                        array[array_ptr] = 0;
-                    }
-                    if (printf_optimized)
-                    {
-                        if (!printf_printed)
-                        {
-                            fprintf(outFile, "printf(\"");
-                            printf_printed = true;
-                        }
-                        fprintf(outFile, "%%c");
-                        snprintf(printf_args + index_pa, sizeof(printf_args) - index_pa, ",*ptr");
-                        index_pa += 5;
-                    }
-                    else
-                        fprintf(outFile, "putchar(*ptr);");
-                    break;
-                case ',':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    if (array_ptr_diff)
-                    {
-                        if (array_ptr_diff > 1)
-                            fprintf(outFile, "ptr+=%i;", array_ptr_diff);
-                        else if (array_ptr_diff == 1)
-                            fprintf(outFile, "++ptr;");
-                        else if (array_ptr_diff == -1)
-                            fprintf(outFile, "--ptr;");
-                        else
-                            fprintf(outFile, "ptr-=%i;", -array_ptr_diff);
-                        array_ptr_diff = 0;
-                    }
-                    array[array_ptr] = 0;
-                    fprintf(outFile, "*ptr=getchar();");
-                    break;      
-                case '[':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    if (array_ptr_diff)
-                    {
-                        if (array_ptr_diff > 1)
-                            fprintf(outFile, "ptr+=%i;", array_ptr_diff);
-                        else if (array_ptr_diff == 1)
-                            fprintf(outFile, "++ptr;");
-                        else if (array_ptr_diff == -1)
-                            fprintf(outFile, "--ptr;");
-                        else
-                            fprintf(outFile, "ptr-=%i;", -array_ptr_diff);
-                        array_ptr_diff = 0;
-                    }
-                    if (array[array_ptr])
-                    {
-                        if (array[array_ptr] > 1)
-                            fprintf(outFile, "*ptr+=%i;", array[array_ptr]);
-                        else if (array[array_ptr] == 1)
-                            fprintf(outFile, "++*ptr;");
-                        else if (array[array_ptr] == -1)
-                            fprintf(outFile, "--*ptr;");
-                        else
-                            fprintf(outFile, "*ptr-=%i;", -array[array_ptr]);
-                        array[array_ptr] = 0;
-                    }
-                    fprintf(outFile, "while(*ptr){");
-                    break;
-                case ']':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    if (array_ptr_diff)
-                    {
-                        if (array_ptr_diff > 1)
-                            fprintf(outFile, "ptr+=%i;", array_ptr_diff);
-                        else if (array_ptr_diff == 1)
-                            fprintf(outFile, "++ptr;");
-                        else if (array_ptr_diff == -1)
-                            fprintf(outFile, "--ptr;");
-                        else
-                            fprintf(outFile, "ptr-=%i;", -array_ptr_diff);
-                        array_ptr_diff = 0;
-                    }
-                    if (array[array_ptr])
-                    {
-                        if (array[array_ptr] > 1)
-                            fprintf(outFile, "*ptr+=%i;", array[array_ptr]);
-                        else if (array[array_ptr] == 1)
-                            fprintf(outFile, "++*ptr;");
-                        else if (array[array_ptr] == -1)
-                            fprintf(outFile, "--*ptr;");
-                        else
-                            fprintf(outFile, "*ptr-=%i;", -array[array_ptr]);
-                        array[array_ptr] = 0;
-                    }
-                    fprintf(outFile, "}");
-                    break;
-                case '@':
-                    goto exitwhile3;
-                    break;
-                default:
-                break;
-            }
+            std::vector<loop_plan> checked_plans(program.size(), loop_plan{ -1, 0, false });
+            for (size_t i = 0; i < moved.size(); i++)
+                checked_plans[moved[i]] = plans[i];
+            plans.swap(checked_plans);
         }
-        exitwhile3:
-        if (printf_optimized && printf_printed)
-            fprintf(outFile, "%s);", printf_args);
     }
-    else
-    {
-        // Print the C code onto the file
 
-        fprintf(outFile, "#include <stdio.h>\nint main(){");
-        fprintf(outFile, "char array[");
-        fprintf(outFile, "%li", MEMORY_SIZE);
-        fprintf(outFile, "]={0},*ptr=array;");
+    // The evaluation only stops outside of loops, the code before that point
+    // has already run and is left out
+    const size_t begin = resume == SIZE_MAX ? 0 : resume;
+
+    const bool output_runtime = std::any_of(program.begin(), program.end(), [](const instruction &ins) { return ins.op == OP_OUT || ins.op == OP_PUT || ins.op == OP_IN; });
+    const bool scans_right = std::any_of(program.begin() + begin, program.end(), [](const instruction &ins) { return ins.op == OP_SCAN && ins.arg > 0; });
+    const bool scans_left = std::any_of(program.begin() + begin, program.end(), [](const instruction &ins) { return ins.op == OP_SCAN && ins.arg < 0; });
+
+    text_writer out;
+    print_cell_type(out, options.cell_bits);
+    if (output_runtime)
+        print_io_runtime(out, output_buffer_size, eof);
+    if (!state.finished)
+        print_tape_runtime(out, options.tape_size);
+    if (!state.finished && options.checked)
+        print_check_runtime(out);
+    if (!state.finished && options.cell_bits == 8 && (scans_right || scans_left))
+        print_scan_runtime(out, scans_right, scans_left);
+
+    write_text(out, "int main(int argc,char**argv){");
+    if (output_runtime)
+        write_text(out, "bf_open_input(argc,argv);");
 
-        while (*++buf_ptr)
+    print_constant_output(out, state.output);
+
+    if (!state.finished)
+    {
+        // Only the cells up to the last non-zero one need an initializer
+        size_t used = state.tape.size();
+        while (used && !state.tape[used - 1])
+            --used;
+
+        write_text(out, "bf_cell*ptr=(bf_cell*)bf_tape_open();");
+        if (options.checked)
+            write_text(out, "bf_cell*const bf_base=ptr;const unsigned long long bf_cells=(size_t)(bf_tape_end-bf_tape)/sizeof(bf_cell);");
+        if (used)
         {
-            switch (*buf_ptr)
+            write_format(out, "static const bf_cell bf_init[%zu]={", used);
+            for (size_t i = 0; i < used; i++)
             {
-                // Handling BF statements
-                case '>':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    fprintf(outFile, "++ptr;");
-                    break;
-                case '<':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    fprintf(outFile, "--ptr;");
-                    break;
-                case '+':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    fprintf(outFile, "++*ptr;");
-                    break;
-                case '-':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    fprintf(outFile, "--*ptr;");
-                    break;
-                case '.':
-                    if (printf_optimized)
-                    {
-                        if (!printf_printed)
-                        {
-                            fprintf(outFile, "printf(\"");
-                            printf_printed = true;
-                        }
-                        fprintf(outFile, "%%c");
-                        snprintf(printf_args + index_pa, sizeof(printf_args) - index_pa, ",*ptr");
-                        index_pa += 5;
-                    }
-                    else
-                        fprintf(outFile, "putchar(*ptr);");
-                    break;
-                case ',':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    fprintf(outFile, "*ptr = getchar();");
-                    break;      
-                case '[':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    fprintf(outFile, "while(*ptr){");
-                    break;
-                case ']':
-                    if (printf_optimized && printf_printed)
-                    {
-                        fprintf(outFile, "\"%s);", printf_args);
-                        index_pa = 0;
-                        memset(printf_args, 0, sizeof(printf_args));
-                        printf_printed = false;
-                    }
-                    fprintf(outFile, "}");
-                    break;
-                case '@':
-                    goto exitwhile2;
-                    break;
-                default:
-                break;
+                if (i)
+                    write_char(out, ',');
+                print_cell_value(out, options.cell_bits, (int64_t)state.tape[i]);
             }
-        }    
-        exitwhile2:
-        if (printf_optimized && printf_printed)
-            fprintf(outFile, "\"%s);", printf_args);
+            write_text(out, "};memcpy(ptr,bf_init,sizeof bf_init);");
+        }
+        print_adjust(out, "ptr", state.ptr);
+
+        print_program(out, program, options.cell_bits, begin, loop_plans);
     }
 
+    // Hand the remaining output over before leaving
+    if (output_runtime)
+        write_text(out, "bf_flush();");
 
     // Closing bracket for 'int main()' function
-    fprintf(outFile, "return 0;}");
+    write_text(out, "return 0;}");
 
-    fclose(outFile);
+    const bool written = write_text_file(out, c_output_filename);
+    close_source(source);
+    if (!written)
+        return 1;
 
     // Compile the file using GCC, which is hopefully on the %PATH%.
 
-    char compile_command[550];
+    std::string compile_command = "gcc -std=c23 ";
     if (c_optimized[0])
-        snprintf(compile_command, sizeof(compile_command), "gcc -std=c23 -O%s %s -o %s", c_optimized, c_output_filename, output_filename);
-    else
-        snprintf(compile_command, sizeof(compile_command), "gcc -std=c23 %s -o %s", c_output_filename, output_filename);
-        
-    printf("%s\n%s\n%s\n%s", c_output_filename, output_filename, compile_command, c_optimized);
+        compile_command += std::string("-O") + c_optimized + " ";
+    compile_command += shell_quote(c_output_filename) + " -o " + shell_quote(output_filename);
+
+    fprintf(log, "%s\n%s\n%s\n%s", c_output_filename, output_filename, compile_command.c_str(), c_optimized);
+    fflush(log);
 
-    const int compile_result = system(compile_command);
+    const int compile_result = system(compile_command.c_str());
 
     if (compile_result) {
-        printf("\nError compiling C code with GCC: %i", compile_result);
+        fprintf(log, "\nError compiling C code with GCC: %i", compile_result);
         return 1;
     }
 
-    printf("\nGCC compilation successful. Output executable: %s\n", output_filename);
+    if (!cache_dir.empty())
+    {
+        cache_store(cache_dir, key, ".c", c_output_filename);
+        cache_store(cache_dir, key, ".exe", output_filename);
+    }
+
+    fprintf(log, "\nGCC compilation successful. Output executable: %s\n", output_filename);
 
     // Delete the generated C file
     /*if (unlink(c_output_filename) == -1) {
@@ -684,4 +821,290 @@ int main(int argc, const char *argv[])
     }*/
 
     return 0;
-}
\ No newline at end of file
+}
+
+// path with its extension (if any) replaced by extension
+std::string replace_extension(const std::string &path, const char *extension)
+{
+    const size_t name = path.find_last_of("/\\");
+    const size_t dot = path.rfind('.');
+    const bool has_extension = dot != std::string::npos && (name == std::string::npos || dot > name + 1) && dot != 0;
+    return (has_extension ? path.substr(0, dot) : path) + extension;
+}
+
+// Adds the programs listed in a manifest, one path per line relative to the
+// manifest itself, skipping blank lines and lines starting with #
+bool read_manifest(const char *path, std::vector<std::string> &inputs)
+{
+    source_file manifest;
+    if (!open_source(path, manifest))
+        return false;
+
+    const std::string manifest_path = path;
+    const size_t name = manifest_path.find_last_of("/\\");
+    const std::string directory = name == std::string::npos ? std::string() : manifest_path.substr(0, name + 1);
+
+    const char *line = manifest.data, *const end = manifest.data + manifest.size;
+    while (line < end)
+    {
+        const char *line_end = (const char *)memchr(line, '\n', end - line);
+        if (!line_end)
+            line_end = end;
+
+        const char *first = line, *last = line_end;
+        while (first < last && isspace((unsigned char)*first))
+            ++first;
+        while (last > first && isspace((unsigned char)last[-1]))
+            --last;
+        if (first < last && *first != '#')
+        {
+            const bool absolute = *first == '/' || *first == '\\' || (last - first > 1 && first[1] == ':');
+            inputs.push_back((absolute ? std::string() : directory) + std::string(first, last));
+        }
+
+        line = line_end + 1;
+    }
+
+    close_source(manifest);
+    return true;
+}
+
+// Builds every input on a work-stealing pool. Each job has its own output
+// names (the input's name with .exe and .c, next to it or in output_dir) and
+// collects its messages in a private temporary file, printed in one piece
+// once the job is done.
+int compile_batch(const compile_options &options, const std::vector<std::string> &inputs, const char *output_dir, const unsigned workers)
+{
+    std::vector<std::string> outputs, c_outputs;
+    for (const std::string &input : inputs)
+    {
+        std::string base = input;
+        if (output_dir)
+        {
+            const size_t name = input.find_last_of("/\\");
+            base = std::string(output_dir) + "/" + (name == std::string::npos ? input : input.substr(name + 1));
+        }
+        outputs.push_back(replace_extension(base, options.bytecode ? ".bfc" : ".exe"));
+        c_outputs.push_back(replace_extension(base, ".c"));
+    }
+
+    std::vector<std::string> sorted = outputs;
+    std::sort(sorted.begin(), sorted.end());
+    const auto duplicate = std::adjacent_find(sorted.begin(), sorted.end());
+    if (duplicate != sorted.end()) {
+        fprintf(stderr, "Error: More than one input would be built to %s\n", duplicate->c_str());
+        return 1;
+    }
+
+    if (output_dir && !make_directories(output_dir)) {
+        fprintf(stderr, "Error: Could not create directory %s\n", output_dir);
+        return 1;
+    }
+
+    std::vector<int> results(inputs.size(), 1);
+    std::mutex report_lock;
+
+    run_parallel(inputs.size(), workers, [&](const size_t job)
+    {
+        FILE *log = tmpfile();
+        if (!log) {
+            perror("Error creating temporary file");
+            return;
+        }
+
+        results[job] = compile_file(options, inputs[job].c_str(), outputs[job].c_str(), c_outputs[job].c_str(), log);
+
+        std::lock_guard<std::mutex> guard(report_lock);
+        printf("== %s ==\n", inputs[job].c_str());
+        rewind(log);
+        char chunk[4096];
+        size_t bytes_read;
+        while ((bytes_read = fread(chunk, 1, sizeof(chunk), log)) > 0)
+            fwrite(chunk, 1, bytes_read, stdout);
+        fflush(stdout);
+        fclose(log);
+    });
+
+    const size_t failed = std::count_if(results.begin(), results.end(), [](const int result) { return result != 0; });
+    printf("Built %zu of %zu programs\n", inputs.size() - failed, inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++)
+        if (results[i])
+            printf("Failed: %s\n", inputs[i].c_str());
+
+    return failed ? 1 : 0;
+}
+
+int main(int argc, const char *argv[]) 
+{
+    /*
+        Flags in target program
+        -O[0-2] 0 prints the program as parsed, 1 enables code-logic optimizations, 2 enables compile-time evaluation
+        -eval-steps=<n> with -O2, stops compile-time evaluation after n instructions (100000000 by default)
+        -eval-ms=<ms> with -O2, stops compile-time evaluation after ms milliseconds (no limit by default)
+        -Opf is accepted for compatibility, output is always collected in a buffer and written in bulk now
+        -Oc[0-3, fast] specifies internal GCC's optimization flag for C code
+        -buffer-size=<bytes> size of the output buffer in the generated program (or the JIT), 65536 by default
+        -eof=[unchanged, 0, -1] what , stores once the input is exhausted, -1 by default
+        -cell-bits=[8, 16, 32, 64] width of a cell in the generated program, cells wrap around at that width, 8 by default (-jit and -elf only support 8)
+        -tape-size=<bytes>[K, M, G] size of the tape, reserved up front and only backed by memory as the program reaches it, 1G by default
+        -input=<path> with -jit, reads the program's input from a file instead of stdin (compiled programs take it as their first argument)
+        -jit compiles the program to x86-64 machine code in memory and runs it right away, no C output or GCC involved
+        -elf writes the program as a static Linux x86-64 executable straight to the -o file, no C output or GCC involved
+        -checked makes the program check that it stays on the tape, once per stretch of straight-line code or balanced loop entry instead of at every access (not with -jit or -elf)
+        -bytecode writes the optimized program to the -o file (out.bfc by default) for bf_interpreter to run without parsing, with -O2 along with the output, tape and position compile-time evaluation got to
+        -fprofile-use=<path> with -O1 and -O2, shapes loops by a profile from bf_interpreter --write-profile: hints, unrolling and peeling
+        -no-cache always rebuilds, otherwise builds are looked up in and added to $BF_CACHE_DIR (~/.cache/bf_compiler by default)
+
+        With -batch as the first argument, every other argument that is not a flag is a program to build, @<path> adds the programs listed in a manifest
+        -j<n> builds n programs at a time, one per hardware thread by default
+        -o <directory> puts the executables there instead of next to each program
+    */
+
+    if (argc < 2) {
+        printf("Usage: %s {filename}.bf [-O[0-2], -eval-steps=<n>, -eval-ms=<ms>, -Oc[0-3, fast], -buffer-size=<bytes>, -eof=[unchanged, 0, -1], -cell-bits=[8, 16, 32, 64], -tape-size=<bytes>, -jit, -elf, -bytecode, -checked, -fprofile-use=<path>, -no-cache, -input=<path>, -o {filename}.exe]\n", argv[0]);
+        printf("       %s -batch {filename}.bf... [@manifest] [-j<n>, -o <directory>, flags as above]\n", argv[0]);
+        return 1;
+    }
+
+    const bool batch = strcmp(argv[1], "-batch") == 0;
+    const char *input_filename = argv[1];
+    std::string output_filename = "out.exe", c_output_filename = "out.c";
+    bool output_given = false;
+    std::vector<std::string> inputs;
+    const char *output_dir = NULL;
+    unsigned workers = 0;
+    compile_options options;
+
+    // Parse command-line arguments
+    for (int i = 2; i < argc; i++) 
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) 
+        {
+            if (batch)
+                output_dir = argv[i + 1];
+            output_filename = argv[i + 1];
+            output_given = true;
+            // The generated C goes next to it, with the extension swapped for .c
+            c_output_filename = replace_extension(argv[i + 1], ".c");
+            ++i;
+        }
+        else if (strncmp(argv[i], "-Oc", 3) == 0)
+        {
+            substring(argv[i], 3, 5, options.c_optimized);
+        }
+        else if (strcmp(argv[i], "-Opf") == 0)
+        {
+            // Superseded by the output buffer
+        }
+        else if (strncmp(argv[i], "-buffer-size=", 13) == 0)
+        {
+            options.output_buffer_size = strtoull(argv[i] + 13, NULL, 10);
+        }
+        else if (strncmp(argv[i], "-eof=", 5) == 0)
+        {
+            if (!parse_eof_policy(argv[i] + 5, options.eof)) {
+                fprintf(stderr, "Error: -eof expects unchanged, 0 or -1\n");
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "-eval-steps=", 12) == 0)
+        {
+            options.eval_steps = strtoull(argv[i] + 12, NULL, 10);
+        }
+        else if (strncmp(argv[i], "-eval-ms=", 9) == 0)
+        {
+            options.eval_ms = (uint32_t)strtoul(argv[i] + 9, NULL, 10);
+        }
+        else if (strncmp(argv[i], "-cell-bits=", 11) == 0)
+        {
+            if (!parse_cell_bits(argv[i] + 11, options.cell_bits)) {
+                fprintf(stderr, "Error: -cell-bits expects 8, 16, 32 or 64\n");
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "-tape-size=", 11) == 0)
+        {
+            if (!parse_size(argv[i] + 11, options.tape_size)) {
+                fprintf(stderr, "Error: -tape-size expects a number of bytes, optionally followed by K, M or G\n");
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "-input=", 7) == 0)
+        {
+            options.input_path = argv[i] + 7;
+        }
+        else if (strcmp(argv[i], "-jit") == 0)
+        {
+            options.jit = true;
+        }
+        else if (strcmp(argv[i], "-elf") == 0)
+        {
+            options.elf = true;
+        }
+        else if (strcmp(argv[i], "-bytecode") == 0)
+        {
+            options.bytecode = true;
+        }
+        else if (strcmp(argv[i], "-checked") == 0)
+        {
+            options.checked = true;
+        }
+        else if (strncmp(argv[i], "-fprofile-use=", 14) == 0)
+        {
+            options.profile_path = argv[i] + 14;
+        }
+        else if (strcmp(argv[i], "-no-cache") == 0)
+        {
+            options.use_cache = false;
+        }
+        else if (strncmp(argv[i], "-O", 2) == 0)
+        {
+            options.optimization_level = argv[i][2] - '0';
+        }
+        else if (batch && strncmp(argv[i], "-j", 2) == 0)
+        {
+            workers = (unsigned)strtoul(argv[i] + 2, NULL, 10);
+        }
+        else if (batch && argv[i][0] == '@')
+        {
+            if (!read_manifest(argv[i] + 1, inputs))
+                return 1;
+        }
+        else if (batch && argv[i][0] != '-')
+        {
+            inputs.push_back(argv[i]);
+        }
+    }
+
+    // The x86-64 encoder only knows byte cells
+    if ((options.jit || options.elf) && options.cell_bits != 8) {
+        fprintf(stderr, "Error: -jit and -elf only support 8-bit cells\n");
+        return 1;
+    }
+
+    if (options.bytecode && (options.jit || options.elf)) {
+        fprintf(stderr, "Error: -bytecode cannot be combined with -jit or -elf\n");
+        return 1;
+    }
+    // Their machine code has no bounds checks to run
+    if (options.checked && (options.jit || options.elf)) {
+        fprintf(stderr, "Error: -checked cannot be combined with -jit or -elf\n");
+        return 1;
+    }
+    if (options.bytecode && !output_given)
+        output_filename = "out.bfc";
+
+    if (!batch)
+        return compile_file(options, input_filename, output_filename.c_str(), c_output_filename.c_str(), stdout);
+
+    if (options.jit) {
+        fprintf(stderr, "Error: -jit runs a single program and cannot be combined with -batch\n");
+        return 1;
+    }
+    if (inputs.empty()) {
+        fprintf(stderr, "Error: -batch needs at least one program\n");
+        return 1;
+    }
+
+    return compile_batch(options, inputs, output_dir, workers);
+}
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include "bf_io.hpp"
+#include "bf_ir.hpp"
+#include "bf_jit.hpp"
+#include "bf_tape.hpp"
+
+// A static Linux x86-64 executable needs neither a C compiler nor libc: one
+// read-only executable segment holds the headers and the code, one
+// zero-filled writable segment holds the output buffer and the input buffer.
+// Every address there fits an imm32, so the code uses the short forms. The
+// tape is mapped at startup between two guard regions, like bf_tape.hpp's.
+// There is no fault handler to grow it, so all of it is mapped up front
+// without reserving swap and the kernel backs it as the program touches it;
+// running into a guard region kills the program with SIGSEGV.
+#define ELF_CODE_ADDRESS 0x400000u
+#define ELF_DATA_ADDRESS 0x10000000u
+#define ELF_HEADER_SIZE (64 + 3 * 56)
+#define ELF_MAX_BUFFER_SIZE 0x40000000u
+
+// Register use in the generated code: rbx is the cell pointer, r12 the output
+// cursor, r13/r14 the unread part of the input buffer and r15 the input file
+// descriptor (-1 once it is exhausted)
+struct elf_layout
+{
+    uint32_t output, output_end, input, data_size;
+    uint64_t tape_size;
+};
+
+inline void elf_emit16(std::vector<uint8_t>& code, const uint16_t value)
+{
+    code.push_back(static_cast<uint8_t>(value));
+    code.push_back(static_cast<uint8_t>(value >> 8));
+}
+
+// call rel32 to a routine already in code
+inline void elf_emit_call(std::vector<uint8_t>& code, const size_t target)
+{
+    jit_emit(code, { 0xE8 });
+    jit_emit32(code, static_cast<uint32_t>(target - (code.size() + 4)));
+}
+
+// Points the rel8 of the jump emitted just before from at the end of code
+inline void elf_patch8(std::vector<uint8_t>& code, const size_t from)
+{
+    code[from - 1] = static_cast<uint8_t>(code.size() - from);
+}
+
+// Hands everything between the start of the output buffer and r12 to stdout
+inline void elf_emit_flush(std::vector<uint8_t>& code, const elf_layout& layout)
+{
+    // mov esi, output
+    jit_emit(code, { 0xBE });
+    jit_emit32(code, layout.output);
+
+    // loop: mov rdx, r12; sub rdx, rsi; je done
+    const size_t loop = code.size();
+    jit_emit(code, { 0x4C, 0x89, 0xE2, 0x48, 0x29, 0xF2, 0x74, 0x00 });
+    const size_t empty = code.size();
+
+    // mov edi, 1; mov eax, 1 (write); syscall; test rax, rax; jle done
+    jit_emit(code, { 0xBF, 0x01, 0x00, 0x00, 0x00, 0xB8, 0x01, 0x00, 0x00, 0x00, 0x0F, 0x05 });
+    jit_emit(code, { 0x48, 0x85, 0xC0, 0x7E, 0x00 });
+    const size_t failed = code.size();
+
+    // add rsi, rax; jmp loop
+    jit_emit(code, { 0x48, 0x01, 0xC6, 0xEB, static_cast<uint8_t>(loop - (code.size() + 5)) });
+
+    // done: mov r12d, output; ret
+    elf_patch8(code, empty);
+    elf_patch8(code, failed);
+    jit_emit(code, { 0x41, 0xBC });
+    jit_emit32(code, layout.output);
+    jit_emit(code, { 0xC3 });
+}
+
+// Implements , for the cell at rbx, refilling the input buffer as needed
+inline void elf_emit_read_cell(std::vector<uint8_t>& code, const elf_layout& layout, const size_t flush, const eof_policy eof)
+{
+    // cmp r13, r14; jb have; test r15d, r15d; js exhausted
+    jit_emit(code, { 0x4D, 0x39, 0xF5, 0x72, 0x00 });
+    const size_t buffered = code.size();
+    jit_emit(code, { 0x45, 0x85, 0xFF, 0x78, 0x00 });
+    const size_t closed = code.size();
+
+    // Output the program is waiting on goes out before blocking
+    elf_emit_call(code, flush);
+
+    // mov edi, r15d; mov esi, input; mov edx, size; xor eax, eax (read); syscall
+    jit_emit(code, { 0x44, 0x89, 0xFF, 0xBE });
+    jit_emit32(code, layout.input);
+    jit_emit(code, { 0xBA });
+    jit_emit32(code, DEFAULT_INPUT_BUFFER_SIZE);
+    jit_emit(code, { 0x31, 0xC0, 0x0F, 0x05 });
+
+    // test rax, rax; jle at_end; mov r13d, input; lea r14, [r13 + rax]
+    jit_emit(code, { 0x48, 0x85, 0xC0, 0x7E, 0x00 });
+    const size_t at_end = code.size();
+    jit_emit(code, { 0x41, 0xBD });
+    jit_emit32(code, layout.input);
+    jit_emit(code, { 0x4D, 0x8D, 0x74, 0x05, 0x00 });
+
+    // have: mov al, [r13]; mov [rbx], al; inc r13; ret
+    elf_patch8(code, buffered);
+    jit_emit(code, { 0x41, 0x8A, 0x45, 0x00, 0x88, 0x03, 0x49, 0xFF, 0xC5, 0xC3 });
+
+    // at_end: mov r15d, -1; exhausted: apply the EOF policy; ret
+    elf_patch8(code, at_end);
+    jit_emit(code, { 0x41, 0xBF, 0xFF, 0xFF, 0xFF, 0xFF });
+    elf_patch8(code, closed);
+    if (eof == EOF_ZERO)
+        jit_emit(code, { 0xC6, 0x03, 0x00 });
+    else if (eof == EOF_MINUS_ONE)
+        jit_emit(code, { 0xC6, 0x03, 0xFF });
+    jit_emit(code, { 0xC3 });
+}
+
+// Translates the program into the code segment, returns the offset of the
+// entry point
+inline size_t elf_generate(const std::vector<instruction>& program, const elf_layout& layout, const eof_policy eof, std::vector<uint8_t>& code)
+{
+    std::vector<size_t> loop_stack;
+    int32_t shift = 0;
+
+    const size_t flush = code.size();
+    elf_emit_flush(code, layout);
+    const size_t read_cell = code.size();
+    elf_emit_read_cell(code, layout, flush, eof);
+
+    // mmap(0, guard + tape + guard, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+    // MAP_NORESERVE, -1, 0): xor edi, edi; mov rsi, size; xor edx, edx;
+    // mov r10d, flags; or r8, -1; xor r9d, r9d; mov eax, 9; syscall
+    const size_t entry = code.size();
+    jit_emit(code, { 0x31, 0xFF, 0x48, 0xBE });
+    jit_emit64(code, layout.tape_size + 2 * TAPE_GUARD_SIZE);
+    jit_emit(code, { 0x31, 0xD2, 0x41, 0xBA });
+    jit_emit32(code, 0x4022);
+    jit_emit(code, { 0x49, 0x83, 0xC8, 0xFF, 0x45, 0x31, 0xC9, 0xB8, 0x09, 0x00, 0x00, 0x00, 0x0F, 0x05 });
+
+    // mprotect(rbx = the first cell, tape, PROT_READ | PROT_WRITE), which also
+    // fails if mmap did: lea rbx, [rax + guard]; mov rdi, rbx; mov rsi, tape;
+    // mov edx, 3; mov eax, 10; syscall; test eax, eax; je mapped; exit(1)
+    jit_emit(code, { 0x48, 0x8D, 0x98 });
+    jit_emit32(code, TAPE_GUARD_SIZE);
+    jit_emit(code, { 0x48, 0x89, 0xDF, 0x48, 0xBE });
+    jit_emit64(code, layout.tape_size);
+    jit_emit(code, { 0xBA, 0x03, 0x00, 0x00, 0x00, 0xB8, 0x0A, 0x00, 0x00, 0x00, 0x0F, 0x05, 0x85, 0xC0, 0x74, 0x00 });
+    const size_t mapped = code.size();
+    jit_emit(code, { 0xBF, 0x01, 0x00, 0x00, 0x00, 0xB8, 0x3C, 0x00, 0x00, 0x00, 0x0F, 0x05 });
+    elf_patch8(code, mapped);
+
+    // mov r12d, output; mov r13d, input; mov r14d, input; xor r15d, r15d
+    jit_emit(code, { 0x41, 0xBC });
+    jit_emit32(code, layout.output);
+    jit_emit(code, { 0x41, 0xBD });
+    jit_emit32(code, layout.input);
+    jit_emit(code, { 0x41, 0xBE });
+    jit_emit32(code, layout.input);
+    jit_emit(code, { 0x45, 0x31, 0xFF });
+
+    // Like the generated C, read the input from the file named by the first
+    // argument when there is one: cmp qword [rsp], 2; jb program;
+    // mov rdi, [rsp + 16]; xor esi, esi; mov eax, 2 (open); syscall;
+    // mov r15d, eax; test eax, eax; jns program; exit(1)
+    jit_emit(code, { 0x48, 0x83, 0x3C, 0x24, 0x02, 0x72, 0x00 });
+    const size_t no_argument = code.size();
+    jit_emit(code, { 0x48, 0x8B, 0x7C, 0x24, 0x10, 0x31, 0xF6, 0xB8, 0x02, 0x00, 0x00, 0x00, 0x0F, 0x05 });
+    jit_emit(code, { 0x41, 0x89, 0xC7, 0x85, 0xC0, 0x79, 0x00 });
+    const size_t opened = code.size();
+    jit_emit(code, { 0xBF, 0x01, 0x00, 0x00, 0x00, 0xB8, 0x3C, 0x00, 0x00, 0x00, 0x0F, 0x05 });
+    elf_patch8(code, no_argument);
+    elf_patch8(code, opened);
+
+    for (const instruction& ins : program)
+    {
+        if (jit_emit_tape_instruction(code, ins, loop_stack, shift))
+            continue;
+
+        switch (ins.op)
+        {
+            case OP_OUT:
+            case OP_PUT:
+                // mov al, [rbx + shift] (mov al, imm8 for OP_PUT); mov [r12], al; inc r12; cmp r12, output_end; jb next; call flush
+                if (ins.op == OP_OUT)
+                {
+                    jit_emit(code, { 0x8A });
+                    jit_emit_cell(code, 0, shift);
+                }
+                else
+                    jit_emit(code, { 0xB0, static_cast<uint8_t>(ins.arg) });
+                jit_emit(code, { 0x41, 0x88, 0x04, 0x24, 0x49, 0xFF, 0xC4, 0x49, 0x81, 0xFC });
+                jit_emit32(code, layout.output_end);
+                jit_emit(code, { 0x72, 0x05 });
+                elf_emit_call(code, flush);
+                break;
+            case OP_IN:
+                // The reader works on the cell at rbx
+                jit_emit_shift(code, shift);
+                elf_emit_call(code, read_cell);
+                break;
+            case OP_END:
+                // call flush; mov eax, 60 (exit); xor edi, edi; syscall
+                elf_emit_call(code, flush);
+                jit_emit(code, { 0xB8, 0x3C, 0x00, 0x00, 0x00, 0x31, 0xFF, 0x0F, 0x05 });
+                break;
+            default:
+                break;
+        }
+    }
+
+    return entry;
+}
+
+inline void elf_emit_segment(std::vector<uint8_t>& image, const uint32_t type, const uint32_t flags, const uint64_t address, const uint64_t file_size, const uint64_t memory_size)
+{
+    jit_emit32(image, type);
+    jit_emit32(image, flags);
+    jit_emit64(image, 0);            // p_offset
+    jit_emit64(image, address);      // p_vaddr
+    jit_emit64(image, address);      // p_paddr
+    jit_emit64(image, file_size);
+    jit_emit64(image, memory_size);
+    jit_emit64(image, type == 1 ? 0x1000 : 0x10);
+}
+
+// Writes the program as a ready-to-run executable, prints the reason and
+// returns false on failure
+inline bool elf_write(const char* path, const std::vector<instruction>& program, const size_t buffer_size, const eof_policy eof, const size_t tape_size)
+{
+    if (buffer_size > ELF_MAX_BUFFER_SIZE)
+    {
+        fprintf(stderr, "Error: -buffer-size can be at most %u with -elf\n", ELF_MAX_BUFFER_SIZE);
+        return false;
+    }
+
+    elf_layout layout;
+    layout.output = ELF_DATA_ADDRESS;
+    layout.output_end = layout.output + static_cast<uint32_t>(buffer_size ? buffer_size : 1);
+    layout.input = (layout.output_end + 15) & ~15u;
+    layout.data_size = layout.input + DEFAULT_INPUT_BUFFER_SIZE - ELF_DATA_ADDRESS;
+    layout.tape_size = (tape_size + 0xFFF) & ~0xFFFull;
+
+    std::vector<uint8_t> code;
+    const size_t entry = elf_generate(program, layout, eof, code);
+
+    if (ELF_CODE_ADDRESS + ELF_HEADER_SIZE + code.size() > ELF_DATA_ADDRESS)
+    {
+        fprintf(stderr, "Error: Program is too large for -elf\n");
+        return false;
+    }
+
+    const uint64_t image_size = ELF_HEADER_SIZE + code.size();
+    std::vector<uint8_t> image;
+    image.reserve(image_size);
+
+    // ELF header: 64-bit, little endian, System V, executable, x86-64
+    jit_emit(image, { 0x7F, 'E', 'L', 'F', 2, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0 });
+    elf_emit16(image, 2);
+    elf_emit16(image, 0x3E);
+    jit_emit32(image, 1);
+    jit_emit64(image, ELF_CODE_ADDRESS + ELF_HEADER_SIZE + entry);
+    jit_emit64(image, 64);           // e_phoff
+    jit_emit64(image, 0);            // e_shoff
+    jit_emit32(image, 0);            // e_flags
+    elf_emit16(image, 64);
+    elf_emit16(image, 56);
+    elf_emit16(image, 3);
+    elf_emit16(image, 64);
+    elf_emit16(image, 0);
+    elf_emit16(image, 0);
+
+    // Code (R+X), data (R+W, all of it zero-filled) and a non-executable stack
+    elf_emit_segment(image, 1, 5, ELF_CODE_ADDRESS, image_size, image_size);
+    elf_emit_segment(image, 1, 6, ELF_DATA_ADDRESS, 0, layout.data_size);
+    elf_emit_segment(image, 0x6474E551, 6, 0, 0, 0);
+
+    image.insert(image.end(), code.begin(), code.end());
+
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        perror(path);
+        return false;
+    }
+
+    const bool written = fwrite(image.data(), 1, image.size(), file) == image.size();
+    if (fclose(file) || !written)
+    {
+        perror(path);
+        return false;
+    }
+
+#ifndef _WIN32
+    chmod(path, 0755);
+#endif
+    return true;
+}
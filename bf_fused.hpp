@@ -0,0 +1,41 @@
+#pragma once
+
+// Generated by bench/superinstructions.py, do not edit. Pairs of
+// instructions the threaded engine runs as one superinstruction, ranked by
+// their average share of executed instructions over the corpus:
+//
+//   move add      15.29%
+//   add move       9.25%
+//   add ]          8.31%
+//   set move       5.96%
+//   move ]         5.32%
+//   add out        4.15%
+//   clear move     3.71%
+//   in add         3.35%
+//   out in         3.33%
+//   move set       3.06%
+//   move [         2.85%
+//   scan move      1.92%
+//   add scan       1.91%
+//   ] move         1.87%
+//   [ move         0.96%
+//   [ add          0.86%
+//
+// Corpus: echo.bf, hello.bf, idioms.bf, loops.bf, rot13.bf, squares.bf
+#define BF_FUSED_PAIRS(X) \
+    X(OP_MOVE, OP_ADD) \
+    X(OP_ADD, OP_MOVE) \
+    X(OP_ADD, OP_JNZ) \
+    X(OP_SET, OP_MOVE) \
+    X(OP_MOVE, OP_JNZ) \
+    X(OP_ADD, OP_OUT) \
+    X(OP_CLEAR, OP_MOVE) \
+    X(OP_IN, OP_ADD) \
+    X(OP_OUT, OP_IN) \
+    X(OP_MOVE, OP_SET) \
+    X(OP_MOVE, OP_JZ) \
+    X(OP_SCAN, OP_MOVE) \
+    X(OP_ADD, OP_SCAN) \
+    X(OP_JNZ, OP_MOVE) \
+    X(OP_JZ, OP_MOVE) \
+    X(OP_JZ, OP_ADD)
@@ -3,50 +3,207 @@
 #include <cstdint>
 #include <cstddef>
 #include <cstring>
+#include <vector>
+
+#include "bf_bytecode.hpp"
+#include "bf_lib.hpp"
+#include "bf_source.hpp"
 
 int main(const int argc, char* argv[])
 {
-    char path[32767];
+    /*
+        The program is brainfuck source or bytecode written by bf_compiler -bytecode, which runs without parsing
+
+        Flags
+        --buffer-size=<bytes> size of the output buffer, output is written out when it fills up, before waiting for input and at exit
+        --input=<path> reads the program's input from a file (mapped when possible) instead of stdin
+        --eof=[unchanged, 0, -1] what , stores once the input is exhausted, -1 by default
+        --cell-bits=[8, 16, 32, 64] width of a cell, cells wrap around at that width, 8 by default
+        --tape-size=<bytes>[K, M, G] size of the tape, reserved up front and only backed by memory as the program reaches it, 1G by default
+        --step-limit=<n> stops the program with an error after n instructions (runs the slower switch-based engine)
+        --tiered[=<n>] compiles loops to machine code once they jump back n times (1000 by default) and continues in it, 8-bit cells on x86-64 only
+        --checked checks that the program stays on the tape, once per stretch of straight-line code or balanced loop entry instead of at every access
+        --count prints the number of instructions executed to stderr at exit (runs the slower switch-based engine)
+        --profile[=<path>] counts every instruction and loop and writes a ranked report of the hot loops and instructions to path (stderr by default)
+        --write-profile=<path> counts the same way and writes every loop's entry and iteration counts to path, for bf_compiler -fprofile-use
+        --write-ngrams=<path> counts the same way and writes how often each sequence of 2 or 3 opcodes ran back to back, for bench/superinstructions.py
+    */
 
-    char array[30000] = {0}, *ptr = array;
+    std::vector<char> path;
+    bf_instance_options options;
+    bool count = false, profile = false, cell_bits_given = false, checked = false;
+    const char* profile_path = nullptr;
+    const char* write_profile_path = nullptr;
+    const char* write_ngrams_path = nullptr;
 
-    if (argc > 1)
+    for (int i = 1; i < argc; ++i)
     {
-        strcpy_s(path, argv[1]);
+        if (strncmp(argv[i], "--buffer-size=", 14) == 0)
+            options.output_buffer_size = strtoull(argv[i] + 14, nullptr, 10);
+        else if (strncmp(argv[i], "--input=", 8) == 0)
+            options.input_path = argv[i] + 8;
+        else if (strncmp(argv[i], "--eof=", 6) == 0)
+        {
+            if (!parse_eof_policy(argv[i] + 6, options.eof))
+            {
+                fprintf(stderr, "Error: --eof expects unchanged, 0 or -1\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--tape-size=", 12) == 0)
+        {
+            if (!parse_size(argv[i] + 12, options.tape_size))
+            {
+                fprintf(stderr, "Error: --tape-size expects a number of bytes, optionally followed by K, M or G\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--cell-bits=", 12) == 0)
+        {
+            if (!parse_cell_bits(argv[i] + 12, options.cell_bits))
+            {
+                fprintf(stderr, "Error: --cell-bits expects 8, 16, 32 or 64\n");
+                return EXIT_FAILURE;
+            }
+            cell_bits_given = true;
+        }
+        else if (strncmp(argv[i], "--step-limit=", 13) == 0)
+            options.step_limit = strtoull(argv[i] + 13, nullptr, 10);
+        else if (strcmp(argv[i], "--tiered") == 0)
+            options.tier_threshold = DEFAULT_TIER_THRESHOLD;
+        else if (strncmp(argv[i], "--tiered=", 9) == 0)
+            options.tier_threshold = static_cast<uint32_t>(strtoul(argv[i] + 9, nullptr, 10));
+        else if (strcmp(argv[i], "--checked") == 0)
+            checked = true;
+        else if (strcmp(argv[i], "--count") == 0)
+            count = true;
+        else if (strcmp(argv[i], "--profile") == 0)
+            profile = true;
+        else if (strncmp(argv[i], "--profile=", 10) == 0)
+        {
+            profile = true;
+            profile_path = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--write-profile=", 16) == 0)
+            write_profile_path = argv[i] + 16;
+        else if (strncmp(argv[i], "--write-ngrams=", 15) == 0)
+            write_ngrams_path = argv[i] + 15;
+        else if (path.empty())
+            path.assign(argv[i], argv[i] + strlen(argv[i]));
+        else
+        {
+            fprintf(stderr, "Error: Unexpected argument %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
     }
-    else
+
+    bf_instance instance;
+    if (!bf_open_instance(instance, options))
+        return EXIT_FAILURE;
+
+    if (path.empty())
     {
+        // The path prompt goes through the same reader as the program's input
+        // so no stdin bytes get stuck in a stdio buffer
+        input_reader stdin_reader;
+        if (options.input_path)
+            init_input(stdin_reader, nullptr, options.eof, &instance.out);
+        input_reader& prompt_input = options.input_path ? stdin_reader : instance.in;
+
         fprintf(stderr, "Enter the path to the file: ");
+
+        int chr;
+        while ((chr = get_input(prompt_input)) >= 0 && chr != '\n')
+        {
+            if (chr != '\r')
+                path.push_back(static_cast<char>(chr));
+        }
+    }
+    path.push_back('\0');
+
+    source_file source;
+
+    if (!open_source(path.data(), source))
+        return EXIT_FAILURE;
+
+    // Profiles refer to instructions by their place in the source
+    const bool instrumented = count || profile || write_profile_path || write_ngrams_path;
+    const bool bytecode = is_bytecode(source.data, source.size);
+    bf_program program;
+    if (bytecode && (profile || write_profile_path))
+    {
+        fprintf(stderr, "Error: --profile and --write-profile need the program's source, not bytecode\n");
+        close_source(source);
+        return EXIT_FAILURE;
+    }
+    if (checked && write_profile_path)
+    {
+        // bf_compiler reads profiles against the program without checks
+        fprintf(stderr, "Error: --write-profile cannot be combined with --checked\n");
+        close_source(source);
+        return EXIT_FAILURE;
+    }
+    const unsigned flags = (instrumented ? BF_KEEP_OFFSETS : 0) | (checked ? BF_CHECKED : 0);
+    if (bytecode ? !bytecode_load(path.data(), source.data, source.size, program) :
+                   !bf_compile(source.data, source.size, program, flags))
+    {
+        close_source(source);
+        return EXIT_FAILURE;
     }
 
-    scanf_s("%32767s", path, 32767);
+    // Bytecode built without -checked gets its checks here, resuming where it did
+    if (checked && !program.checked)
+    {
+        program.entry = insert_bounds_checks(program.code, nullptr, program.entry);
+        program.checked = true;
+    }
+
+    // Bytecode with a snapshot picks the cell width
+    if (program.cell_bits && !cell_bits_given)
+        instance.cell_bits = program.cell_bits;
+
+    std::vector<source_position> positions;
+    if (profile)
+        locate_instructions(source.data, program.offsets, positions);
+    close_source(source);
+
+    execution_profile counts;
+    if (instrumented)
+        init_profile(counts, program.code.size());
 
-    FILE* bf_file = fopen(path, "r");
+    const auto start = std::chrono::steady_clock::now();
+    const bf_status status = bf_run(instance, program, instrumented ? &counts : nullptr);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    bf_close_instance(instance);
 
-    if (!bf_file)
+    if (status == BF_TAPE_ERROR)
+        return EXIT_FAILURE;
+    if (status == BF_STEP_LIMIT)
     {
-        fprintf(stderr, "Error: Could not open file %s\n", path);
+        fprintf(stderr, "Error: Stopped after %llu instructions (--step-limit)\n", static_cast<unsigned long long>(options.step_limit));
         return EXIT_FAILURE;
     }
 
-    char line[1024];
+    if (count)
+        fprintf(stderr, "Executed %llu instructions\n", static_cast<unsigned long long>(profile_total(counts)));
 
-    while (fgets(line, 1024, bf_file))
+    if (profile)
     {
-        for (const char i : line)
+        FILE* report = profile_path ? fopen(profile_path, "w") : stderr;
+        if (!report)
         {
-            if (i == '>')
-                ++ptr;
-            else if (i == '<')
-                --ptr;
-            else if (i == '+')
-                ++*ptr;
-            else if (i == '-')
-                --*ptr;
-            else if (i == '.')
-                putchar(*ptr);
-            else if (i == ',')
-                (*ptr) = getchar();
+            perror(profile_path);
+            return EXIT_FAILURE;
         }
+        write_profile_report(report, path.data(), program.code, positions, counts, elapsed.count());
+        if (report != stderr)
+            fclose(report);
     }
-}
\ No newline at end of file
+
+    if (write_profile_path && !write_loop_profile(write_profile_path, program.code, program.offsets, counts))
+        return EXIT_FAILURE;
+    if (write_ngrams_path && !write_ngram_profile(write_ngrams_path, program.code, counts))
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
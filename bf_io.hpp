@@ -0,0 +1,213 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "bf_source.hpp"
+
+#define DEFAULT_OUTPUT_BUFFER_SIZE 65536
+
+// Where output goes and input comes from instead of stdout and stdin, context
+// is passed through; reading 0 bytes means end of input
+typedef void (*write_function)(void* context, const uint8_t* data, size_t size);
+typedef size_t (*read_function)(void* context, uint8_t* data, size_t size);
+
+// Collects program output in user space and hands it to stdout (or write) in
+// bulk, when full, before waiting for input and at exit
+struct output_buffer
+{
+    std::vector<uint8_t> storage;
+    uint8_t *cursor, *end;
+    write_function write;
+    void* context;
+};
+
+inline void init_output(output_buffer& out, const size_t size, const write_function write = nullptr, void* const context = nullptr)
+{
+    out.storage.resize(size ? size : 1);
+    out.cursor = out.storage.data();
+    out.end = out.storage.data() + out.storage.size();
+    out.write = write;
+    out.context = context;
+}
+
+inline void flush_output(output_buffer& out)
+{
+    const size_t length = out.cursor - out.storage.data();
+
+    if (out.write)
+    {
+        if (length)
+            out.write(out.context, out.storage.data(), length);
+    }
+    else
+    {
+        if (length)
+            fwrite(out.storage.data(), 1, length, stdout);
+        fflush(stdout);
+    }
+    out.cursor = out.storage.data();
+}
+
+inline void put_output(output_buffer& out, const uint8_t chr)
+{
+    if (out.cursor == out.end)
+        flush_output(out);
+    *out.cursor++ = chr;
+}
+
+#define DEFAULT_INPUT_BUFFER_SIZE 65536
+
+// What , stores once the input is exhausted
+enum eof_policy : uint8_t
+{
+    EOF_UNCHANGED,  // leave the cell as it was
+    EOF_ZERO,       // store 0
+    EOF_MINUS_ONE   // store -1 (255), what getchar() used to give
+};
+
+// Serves , from a mapped input file or from stdin (or read) in large blocks
+struct input_reader
+{
+    std::vector<uint8_t> storage;
+    const uint8_t *cursor, *end;
+    source_file file;
+    bool from_stdin;    // more blocks may come, false for files and once the stream ended
+    eof_policy eof;
+    output_buffer* out; // flushed before blocking on stdin
+    read_function read;
+    void* context;
+};
+
+inline bool parse_eof_policy(const char* text, eof_policy& eof)
+{
+    if (strcmp(text, "unchanged") == 0)
+        eof = EOF_UNCHANGED;
+    else if (strcmp(text, "0") == 0)
+        eof = EOF_ZERO;
+    else if (strcmp(text, "-1") == 0)
+        eof = EOF_MINUS_ONE;
+    else
+        return false;
+    return true;
+}
+
+// Reads from path, or from read (stdin if that is null too) when path is null
+inline bool init_input(input_reader& in, const char* path, const eof_policy eof, output_buffer* out,
+                       const read_function read = nullptr, void* const context = nullptr)
+{
+    in.eof = eof;
+    in.out = out;
+    in.from_stdin = !path;
+    in.read = read;
+    in.context = context;
+    in.file.data = nullptr;
+    in.file.size = 0;
+    in.file.mapped = false;
+
+    if (path)
+    {
+        if (!open_source(path, in.file))
+            return false;
+        in.cursor = reinterpret_cast<const uint8_t*>(in.file.data);
+        in.end = in.cursor + in.file.size;
+    }
+    else
+    {
+        in.storage.resize(DEFAULT_INPUT_BUFFER_SIZE);
+        in.cursor = in.end = in.storage.data();
+    }
+    return true;
+}
+
+// Waits for the next block of stdin, returns false at end of input
+inline bool refill_input(input_reader& in)
+{
+    if (!in.from_stdin)
+        return false;
+
+    if (in.out)
+        flush_output(*in.out);
+
+    if (in.read)
+    {
+        const size_t bytes_read = in.read(in.context, in.storage.data(), in.storage.size());
+        if (!bytes_read)
+        {
+            in.from_stdin = false;
+            return false;
+        }
+        in.cursor = in.storage.data();
+        in.end = in.cursor + bytes_read;
+        return true;
+    }
+
+#ifdef _WIN32
+    const int bytes_read = _read(_fileno(stdin), in.storage.data(), static_cast<unsigned>(in.storage.size()));
+#else
+    const ssize_t bytes_read = read(STDIN_FILENO, in.storage.data(), in.storage.size());
+#endif
+
+    if (bytes_read <= 0)
+    {
+        in.from_stdin = false;
+        return false;
+    }
+
+    in.cursor = in.storage.data();
+    in.end = in.cursor + bytes_read;
+    return true;
+}
+
+// Returns the next input byte, or -1 at end of input
+inline int get_input(input_reader& in)
+{
+    if (in.cursor == in.end && !refill_input(in))
+        return -1;
+    return *in.cursor++;
+}
+
+// Implements , for one cell of any width, applying the EOF policy (-1 sets
+// every bit)
+template <typename cell>
+inline void read_cell(input_reader& in, cell& value)
+{
+    const int chr = get_input(in);
+
+    if (chr >= 0)
+        value = static_cast<cell>(chr);
+    else if (in.eof == EOF_ZERO)
+        value = 0;
+    else if (in.eof == EOF_MINUS_ONE)
+        value = static_cast<cell>(-1);
+}
+
+// Starts the input over for the next run: a file from its start, a stream
+// with nothing buffered and open again
+inline void rewind_input(input_reader& in)
+{
+    if (in.storage.empty())
+    {
+        in.cursor = reinterpret_cast<const uint8_t*>(in.file.data);
+        in.end = in.cursor + in.file.size;
+    }
+    else
+    {
+        in.cursor = in.end = in.storage.data();
+        in.from_stdin = true;
+    }
+}
+
+inline void close_input(input_reader& in)
+{
+    close_source(in.file);
+}
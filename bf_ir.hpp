@@ -0,0 +1,865 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+#include "bf_scan.hpp"
+
+enum op_code : uint8_t
+{
+    OP_ADD,     // *ptr += arg
+    OP_MOVE,    // ptr += arg
+    OP_OUT,     // putchar(*ptr)
+    OP_IN,      // *ptr = getchar()
+    OP_JZ,      // if (!*ptr) jump past the matching OP_JNZ at index arg
+    OP_JNZ,     // if (*ptr) jump past the matching OP_JZ at index arg
+    OP_CLEAR,   // *ptr = 0
+    OP_MUL,     // ptr[offset] += *ptr * arg
+    OP_SCAN,    // while (*ptr) ptr += arg
+    OP_SET,     // *ptr = arg
+    OP_PUT,     // putchar(arg)
+    OP_CHECK,   // fail unless ptr[arg] through ptr[offset] are on the tape
+    OP_CHECK_LOOP,  // the same, only if *ptr is non-zero: ahead of a balanced loop
+    OP_END
+};
+
+struct instruction
+{
+    op_code op;
+    int32_t arg;
+    int32_t offset;
+};
+
+// Translates the source into instructions, folding runs of +-<> into a single
+// instruction and linking every bracket to its match. When offsets is given it
+// receives, for every instruction, the source offset it starts at.
+inline bool parse_program(const char* source, const size_t length, std::vector<instruction>& program,
+                          std::vector<uint32_t>* offsets = nullptr)
+{
+    std::vector<int32_t> loop_stack;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        const size_t start = i;
+
+        switch (source[i])
+        {
+            case '+':
+            case '-':
+            case '>':
+            case '<':
+            {
+                const bool is_move = source[i] == '>' || source[i] == '<';
+                int32_t count = 0;
+
+                // Fold the run, skipping comment characters in between
+                for (; i < length; ++i)
+                {
+                    const char c = source[i];
+                    if (c == '+' && !is_move) ++count;
+                    else if (c == '-' && !is_move) --count;
+                    else if (c == '>' && is_move) ++count;
+                    else if (c == '<' && is_move) --count;
+                    else if (c == '+' || c == '-' || c == '>' || c == '<' || c == '.' || c == ',' || c == '[' || c == ']')
+                        break;
+                }
+                --i;
+
+                if (count)
+                    program.push_back({ is_move ? OP_MOVE : OP_ADD, count, 0 });
+                break;
+            }
+            case '.':
+                program.push_back({ OP_OUT, 0, 0 });
+                break;
+            case ',':
+                program.push_back({ OP_IN, 0, 0 });
+                break;
+            case '[':
+                loop_stack.push_back(static_cast<int32_t>(program.size()));
+                program.push_back({ OP_JZ, 0, 0 });
+                break;
+            case ']':
+            {
+                if (loop_stack.empty())
+                {
+                    fprintf(stderr, "Error: Unmatched ']' at offset %zu\n", i);
+                    return false;
+                }
+                const int32_t open = loop_stack.back();
+                loop_stack.pop_back();
+                program[open].arg = static_cast<int32_t>(program.size());
+                program.push_back({ OP_JNZ, open, 0 });
+                break;
+            }
+            default:
+                break;
+        }
+
+        if (offsets)
+            offsets->resize(program.size(), static_cast<uint32_t>(start));
+    }
+
+    if (!loop_stack.empty())
+    {
+        fprintf(stderr, "Error: Unmatched '[' (%zu left open)\n", loop_stack.size());
+        return false;
+    }
+
+    program.push_back({ OP_END, 0, 0 });
+    if (offsets)
+        offsets->push_back(static_cast<uint32_t>(length));
+    return true;
+}
+
+// Points every OP_JZ/OP_JNZ at its match, brackets must already be balanced
+inline void link_loops(std::vector<instruction>& program)
+{
+    std::vector<int32_t> loop_stack;
+
+    for (size_t i = 0; i < program.size(); ++i)
+    {
+        if (program[i].op == OP_JZ)
+            loop_stack.push_back(static_cast<int32_t>(i));
+        else if (program[i].op == OP_JNZ)
+        {
+            const int32_t open = loop_stack.back();
+            loop_stack.pop_back();
+            program[open].arg = static_cast<int32_t>(i);
+            program[i].arg = open;
+        }
+    }
+}
+
+// Marks the OP_JZ of every balanced loop: its body, nested loops included,
+// moves the pointer by zero in total and has no scan, so every iteration
+// ends where it started
+inline void find_balanced_loops(const std::vector<instruction>& program, std::vector<bool>& balanced)
+{
+    balanced.assign(program.size(), false);
+
+    struct open_loop
+    {
+        size_t open;
+        int64_t motion;
+        bool balanced;
+    };
+    std::vector<open_loop> loop_stack;
+
+    for (size_t i = 0; i < program.size(); ++i)
+    {
+        const instruction& ins = program[i];
+
+        if (ins.op == OP_JZ)
+            loop_stack.push_back({ i, 0, true });
+        else if (ins.op == OP_JNZ)
+        {
+            const open_loop done = loop_stack.back();
+            loop_stack.pop_back();
+
+            // A nested loop only keeps its parent balanced if it is balanced itself
+            balanced[done.open] = done.balanced && done.motion == 0;
+            if (!loop_stack.empty() && !balanced[done.open])
+                loop_stack.back().balanced = false;
+        }
+        else if (!loop_stack.empty() && ins.op == OP_MOVE)
+            loop_stack.back().motion += ins.arg;
+        else if (!loop_stack.empty() && ins.op == OP_SCAN)
+            loop_stack.back().balanced = false;
+    }
+}
+
+// Recognizes the loop at index open and appends its replacement to out,
+// returns false if the loop is not a known idiom
+inline bool match_loop_idiom(const std::vector<instruction>& program, const size_t open, std::vector<instruction>& out)
+{
+    const size_t close = static_cast<size_t>(program[open].arg);
+
+    if (close - open == 2)
+    {
+        const instruction& body = program[open + 1];
+
+        // [-], [+] and any other odd step reach zero from every value
+        if (body.op == OP_ADD && (body.arg & 1))
+        {
+            out.push_back({ OP_CLEAR, 0, 0 });
+            return true;
+        }
+        // [>], [<<<] and the like
+        if (body.op == OP_MOVE)
+        {
+            out.push_back({ OP_SCAN, body.arg, 0 });
+            return true;
+        }
+    }
+
+    // Copy/multiply loops: only adds and moves, pointer back where it started
+    // and the loop cell stepped by exactly one per iteration
+    std::vector<instruction> deltas;
+    int32_t offset = 0, step = 0;
+
+    for (size_t i = open + 1; i < close; ++i)
+    {
+        const instruction& ins = program[i];
+
+        if (ins.op == OP_MOVE)
+            offset += ins.arg;
+        else if (ins.op != OP_ADD)
+            return false;
+        else if (offset == 0)
+            step += ins.arg;
+        else
+        {
+            bool found = false;
+            for (instruction& delta : deltas)
+            {
+                if (delta.offset == offset)
+                {
+                    delta.arg += ins.arg;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found)
+                deltas.push_back({ OP_MUL, ins.arg, offset });
+        }
+    }
+
+    if (offset != 0 || (step != -1 && step != 1))
+        return false;
+
+    // Counting up runs the loop -*ptr times instead of *ptr times
+    for (instruction& delta : deltas)
+    {
+        if (delta.arg == 0)
+            continue;
+        if (step == 1)
+            delta.arg = -delta.arg;
+        out.push_back(delta);
+    }
+    out.push_back({ OP_CLEAR, 0, 0 });
+    return true;
+}
+
+// What propagate_values knows about the cells, by position relative to where
+// the pointer was when the current frame began. Values are exact sums rather
+// than wrapped at a cell width: 0 is zero at every width and the low byte .
+// writes is the same at every width, so the instruction stream stays valid
+// for all of them.
+struct cell_value
+{
+    bool known;
+    int64_t value;
+};
+
+struct value_state
+{
+    std::unordered_map<int64_t, cell_value> cells;
+    bool untouched_zero;    // cells missing from cells are zero, until the pointer is lost
+    int64_t pos;
+};
+
+inline bool known_value(const value_state& state, const int64_t pos, int64_t& value)
+{
+    const auto found = state.cells.find(pos);
+    if (found == state.cells.end())
+    {
+        value = 0;
+        return state.untouched_zero;
+    }
+    value = found->second.value;
+    return found->second.known;
+}
+
+// Records a value, values that no longer fit an instruction argument become unknown
+inline void set_value(value_state& state, const int64_t pos, const bool known, const int64_t value)
+{
+    state.cells[pos] = { known && value >= INT32_MIN && value <= INT32_MAX, value };
+}
+
+// Starts a new frame after the pointer moved by an unknown distance, where
+// only the current cell is known: it is zero, the loop or scan just ended on it
+inline void lose_pointer(value_state& state)
+{
+    state.cells.clear();
+    state.untouched_zero = false;
+    state.pos = 0;
+    set_value(state, 0, true, 0);
+}
+
+// Appends ins, merging it into the previous instruction where that is exact:
+// adds into adds, moves into moves, and stores over a write to the same cell
+inline void emit_folded(std::vector<instruction>& out, std::vector<uint32_t>* out_offsets, const instruction& ins, const uint32_t offset)
+{
+    if (!out.empty())
+    {
+        instruction& last = out.back();
+        if ((ins.op == OP_ADD || ins.op == OP_MOVE) && last.op == ins.op)
+        {
+            last.arg += ins.arg;
+            if (!last.arg)
+            {
+                out.pop_back();
+                if (out_offsets)
+                    out_offsets->pop_back();
+            }
+            return;
+        }
+        if ((ins.op == OP_SET || ins.op == OP_CLEAR) && (last.op == OP_SET || last.op == OP_CLEAR || last.op == OP_ADD))
+        {
+            last = ins;
+            return;
+        }
+    }
+
+    out.push_back(ins);
+    if (out_offsets)
+        out_offsets->push_back(offset);
+}
+
+// Marks every cell the balanced loop from open to close writes as unknown
+inline void forget_writes(const std::vector<instruction>& program, const size_t open, const size_t close, value_state& state)
+{
+    int64_t motion = 0;
+    for (size_t i = open + 1; i < close; ++i)
+    {
+        const instruction& body = program[i];
+        if (body.op == OP_MOVE)
+            motion += body.arg;
+        else if (body.op == OP_ADD || body.op == OP_IN || body.op == OP_CLEAR || body.op == OP_SET)
+            set_value(state, state.pos + motion, false, 0);
+        else if (body.op == OP_MUL)
+            set_value(state, state.pos + motion + body.offset, false, 0);
+    }
+}
+
+// Rewrites program[begin, end) into out, starting from what state knows and
+// leaving in it what is known afterwards
+inline void propagate_range(const std::vector<instruction>& program, const std::vector<bool>& balanced, const size_t begin,
+                            const size_t end, value_state& state, std::vector<instruction>& out,
+                            const std::vector<uint32_t>* offsets, std::vector<uint32_t>* out_offsets)
+{
+    for (size_t i = begin; i < end; ++i)
+    {
+        const instruction& ins = program[i];
+        const uint32_t offset = offsets ? (*offsets)[i] : 0;
+        int64_t value;
+        const bool known = known_value(state, state.pos, value);
+
+        switch (ins.op)
+        {
+            case OP_ADD:
+                set_value(state, state.pos, known, value + ins.arg);
+                if (known && known_value(state, state.pos, value))
+                    emit_folded(out, out_offsets, { value ? OP_SET : OP_CLEAR, static_cast<int32_t>(value), 0 }, offset);
+                else
+                    emit_folded(out, out_offsets, ins, offset);
+                break;
+            case OP_MOVE:
+                state.pos += ins.arg;
+                emit_folded(out, out_offsets, ins, offset);
+                break;
+            case OP_OUT:
+                if (known)
+                    emit_folded(out, out_offsets, { OP_PUT, static_cast<uint8_t>(value), 0 }, offset);
+                else
+                    emit_folded(out, out_offsets, ins, offset);
+                break;
+            case OP_IN:
+                set_value(state, state.pos, false, 0);
+                emit_folded(out, out_offsets, ins, offset);
+                break;
+            case OP_CLEAR:
+            case OP_SET:
+                if (!known || value != ins.arg)
+                    emit_folded(out, out_offsets, ins, offset);
+                set_value(state, state.pos, true, ins.arg);
+                break;
+            case OP_MUL:
+            {
+                // Nothing to add from a zero cell
+                if (known && !value)
+                    break;
+                int64_t target;
+                const bool target_known = known_value(state, state.pos + ins.offset, target);
+                set_value(state, state.pos + ins.offset, known && target_known, target + value * ins.arg);
+                emit_folded(out, out_offsets, ins, offset);
+                break;
+            }
+            case OP_SCAN:
+                if (known && !value)
+                    break;
+                emit_folded(out, out_offsets, ins, offset);
+                lose_pointer(state);
+                break;
+            case OP_JZ:
+            {
+                const size_t close = static_cast<size_t>(ins.arg);
+
+                // Never entered: the loop right after another loop's ], or
+                // at the start of the program
+                if (known && !value)
+                {
+                    i = close;
+                    break;
+                }
+
+                emit_folded(out, out_offsets, ins, offset);
+                if (balanced[i])
+                {
+                    // Cells the body never writes keep their values in and
+                    // after the loop. The body runs on state itself, without
+                    // a copy: it ends where it started and what it learns
+                    // about the cells it writes is forgotten again.
+                    forget_writes(program, i, close, state);
+                    propagate_range(program, balanced, i + 1, close, state, out, offsets, out_offsets);
+                    forget_writes(program, i, close, state);
+                    set_value(state, state.pos, true, 0);
+                }
+                else
+                {
+                    value_state body_state = { {}, false, state.pos };
+                    propagate_range(program, balanced, i + 1, close, body_state, out, offsets, out_offsets);
+                    lose_pointer(state);
+                }
+                emit_folded(out, out_offsets, program[close], offsets ? (*offsets)[close] : 0);
+                i = close;
+                break;
+            }
+            case OP_JNZ:
+            case OP_PUT:
+            case OP_CHECK:
+            case OP_CHECK_LOOP:
+            case OP_END:
+                emit_folded(out, out_offsets, ins, offset);
+                break;
+        }
+    }
+}
+
+// Tracks which cells hold known values, starting from an all-zero tape, and
+// rewrites the program with them: loops that cannot be entered are deleted,
+// stores and adds to known cells become OP_SET and . of a known cell becomes
+// OP_PUT. offsets, if given, is kept in step.
+inline void propagate_values(std::vector<instruction>& program, std::vector<uint32_t>* offsets = nullptr)
+{
+    std::vector<bool> balanced;
+    find_balanced_loops(program, balanced);
+
+    std::vector<instruction> propagated;
+    std::vector<uint32_t> propagated_offsets;
+    propagated.reserve(program.size());
+
+    value_state state = { {}, true, 0 };
+    propagate_range(program, balanced, 0, program.size(), state, propagated, offsets, offsets ? &propagated_offsets : nullptr);
+
+    link_loops(propagated);
+    program.swap(propagated);
+    if (offsets)
+        offsets->swap(propagated_offsets);
+}
+
+// Replaces innermost loops matching clear, copy/multiply and scan idioms with
+// dedicated instructions and relinks the remaining loops, then folds known
+// cell values with propagate_values. offsets, if given, is kept in step; the
+// replacement of a loop takes the offset of its [.
+inline void optimize_loops(std::vector<instruction>& program, std::vector<uint32_t>* offsets = nullptr)
+{
+    std::vector<instruction> optimized;
+    std::vector<uint32_t> optimized_offsets;
+    optimized.reserve(program.size());
+
+    for (size_t i = 0; i < program.size(); ++i)
+    {
+        const size_t source = i;
+
+        if (program[i].op == OP_JZ && match_loop_idiom(program, i, optimized))
+            i = static_cast<size_t>(program[i].arg);
+        else
+            optimized.push_back(program[i]);
+
+        if (offsets)
+            optimized_offsets.resize(optimized.size(), (*offsets)[source]);
+    }
+
+    link_loops(optimized);
+    program.swap(optimized);
+    if (offsets)
+        offsets->swap(optimized_offsets);
+
+    propagate_values(program, offsets);
+}
+
+// The cells a stretch of code reaches, relative to the pointer at its start
+struct cell_range
+{
+    int64_t low, high;
+    bool any;
+};
+
+inline void reach_cell(cell_range& range, const int64_t pos)
+{
+    range.low = range.any && range.low < pos ? range.low : pos;
+    range.high = range.any && range.high > pos ? range.high : pos;
+    range.any = true;
+}
+
+// Adds the cells of the straight-line region from begin on to range, with the
+// pointer at pos at begin, and returns the index of its last instruction. The
+// region runs through balanced loops, of which only the test counts (their
+// bodies get checked on entry), and ends with the first unbalanced [, ], scan
+// or OP_END, or right before the instruction at stop. Scans bound themselves
+// and are not counted.
+inline size_t scan_region(const std::vector<instruction>& program, const std::vector<bool>& balanced, const size_t begin,
+                          int64_t pos, cell_range& range, const size_t stop)
+{
+    for (size_t i = begin;; ++i)
+    {
+        const instruction& ins = program[i];
+
+        switch (ins.op)
+        {
+            case OP_MOVE:
+                pos += ins.arg;
+                break;
+            case OP_ADD:
+            case OP_OUT:
+            case OP_IN:
+            case OP_CLEAR:
+            case OP_SET:
+                reach_cell(range, pos);
+                break;
+            case OP_MUL:
+                reach_cell(range, pos);
+                reach_cell(range, pos + ins.offset);
+                break;
+            case OP_JZ:
+                reach_cell(range, pos);
+                if (!balanced[i])
+                    return i;
+                i = static_cast<size_t>(ins.arg);
+                break;
+            case OP_JNZ:
+                reach_cell(range, pos);
+                return i;
+            case OP_SCAN:
+            case OP_END:
+                return i;
+            case OP_PUT:
+            case OP_CHECK:
+            case OP_CHECK_LOOP:
+                break;
+        }
+
+        if (i + 1 == stop)
+            return i;
+    }
+}
+
+// Where insert_bounds_checks writes the checked program
+struct check_output
+{
+    std::vector<instruction>& out;
+    const std::vector<uint32_t>* offsets;
+    std::vector<uint32_t>* out_offsets;
+    std::vector<size_t>* moved;
+    size_t resumed;     // where the program resumes, its check included
+};
+
+inline void emit_checked(check_output& output, const std::vector<instruction>& program, const size_t i)
+{
+    if (output.moved)
+        (*output.moved)[i] = output.out.size();
+    output.out.push_back(program[i]);
+    if (output.out_offsets)
+        output.out_offsets->push_back((*output.offsets)[i]);
+}
+
+// Appends a check of range ahead of instruction before, unless range is empty.
+// Positions beyond an instruction argument could never be on the tape anyway.
+inline void emit_check(check_output& output, const op_code op, const cell_range& range, const size_t before)
+{
+    if (!range.any)
+        return;
+    const int32_t low = range.low < INT32_MIN ? INT32_MIN : range.low > INT32_MAX ? INT32_MAX : static_cast<int32_t>(range.low);
+    const int32_t high = range.high < INT32_MIN ? INT32_MIN : range.high > INT32_MAX ? INT32_MAX : static_cast<int32_t>(range.high);
+    output.out.push_back({ op, low, high });
+    if (output.out_offsets)
+        output.out_offsets->push_back((*output.offsets)[before]);
+}
+
+// The check at the resume point has to stand in for every check a run that
+// resumes there skips, the rest of its region. Runs only resume outside of
+// loops (see evaluate_cells).
+inline void emit_resume_check(check_output& output, const std::vector<instruction>& program, const std::vector<bool>& balanced,
+                              const size_t resume)
+{
+    cell_range range = { 0, 0, false };
+    scan_region(program, balanced, resume, 0, range, SIZE_MAX);
+    output.resumed = output.out.size();
+    emit_check(output, OP_CHECK, range, resume);
+}
+
+inline void emit_balanced_checked(check_output& output, const std::vector<instruction>& program, const std::vector<bool>& balanced,
+                                  const size_t open)
+{
+    const size_t close = static_cast<size_t>(program[open].arg);
+
+    // The body ends where it started, so one check before the first
+    // iteration covers all of them
+    cell_range body = { 0, 0, false };
+    scan_region(program, balanced, open + 1, 0, body, SIZE_MAX);
+    emit_check(output, OP_CHECK_LOOP, body, open);
+    emit_checked(output, program, open);
+
+    for (size_t i = open + 1; i < close; ++i)
+    {
+        if (program[i].op == OP_JZ)
+        {
+            emit_balanced_checked(output, program, balanced, i);
+            i = static_cast<size_t>(program[i].arg);
+        }
+        else
+            emit_checked(output, program, i);
+    }
+    emit_checked(output, program, close);
+}
+
+// Copies program[begin, end) region by region, each behind one check
+inline void emit_regions_checked(check_output& output, const std::vector<instruction>& program, const std::vector<bool>& balanced,
+                                 const size_t begin, const size_t end, const size_t resume)
+{
+    for (size_t i = begin; i < end;)
+    {
+        cell_range range = { 0, 0, false };
+        const size_t last = scan_region(program, balanced, i, 0, range, resume);
+        if (i == resume)
+            emit_resume_check(output, program, balanced, resume);
+        else
+            emit_check(output, OP_CHECK, range, i);
+
+        size_t next = last + 1;
+        for (size_t j = i; j <= last; ++j)
+        {
+            const size_t close = static_cast<size_t>(program[j].arg);
+            if (program[j].op == OP_JZ && balanced[j])
+            {
+                emit_balanced_checked(output, program, balanced, j);
+                j = close;
+            }
+            else if (program[j].op == OP_JZ)
+            {
+                // Every iteration of an unbalanced loop starts a new region
+                emit_checked(output, program, j);
+                emit_regions_checked(output, program, balanced, j + 1, close + 1, SIZE_MAX);
+                next = close + 1;
+            }
+            else
+                emit_checked(output, program, j);
+        }
+        i = next;
+    }
+}
+
+// Makes the program check its own tape accesses, with one check per region of
+// straight-line code (up to an unbalanced loop or scan, through balanced
+// loops) and one per entry to a balanced loop, instead of one per access.
+// A program resumed at index resume (SIZE_MAX for none), which is outside of
+// every loop, gets a check there too; the index to resume the checked program
+// at is returned. offsets, if given, is kept in step, and moved, if given,
+// receives the new index of every old instruction.
+inline size_t insert_bounds_checks(std::vector<instruction>& program, std::vector<uint32_t>* offsets = nullptr,
+                                   const size_t resume = SIZE_MAX, std::vector<size_t>* moved = nullptr)
+{
+    std::vector<bool> balanced;
+    find_balanced_loops(program, balanced);
+
+    std::vector<instruction> checked;
+    std::vector<uint32_t> checked_offsets;
+    checked.reserve(program.size() + program.size() / 4);
+    if (moved)
+        moved->assign(program.size(), 0);
+
+    check_output output = { checked, offsets, offsets ? &checked_offsets : nullptr, moved, SIZE_MAX };
+    emit_regions_checked(output, program, balanced, 0, program.size(), resume);
+
+    link_loops(checked);
+    program.swap(checked);
+    if (offsets)
+        offsets->swap(checked_offsets);
+    return output.resumed;
+}
+
+// ptr[offset] += *ptr * factor for OP_MUL, multiplied unsigned so it wraps
+// at the cell width instead of overflowing
+template <typename cell>
+inline cell multiply_cell(const cell value, const int32_t factor)
+{
+    return static_cast<cell>(static_cast<uint64_t>(value) * static_cast<uint64_t>(factor));
+}
+
+// How far partial_evaluate got: the tape (whatever the cell width), pointer
+// and output at the point it stopped, and the instruction the residual
+// program resumes at, which is never inside a loop
+struct evaluation_state
+{
+    std::vector<uint64_t> tape;
+    int32_t ptr;
+    size_t pc;
+    uint64_t steps;
+    std::vector<char> output;
+    bool finished;
+};
+
+// Runs the program ahead of time on cells of type cell until it finishes,
+// needs input, would leave the tape, has executed step_limit instructions or
+// has run for time_limit_ms milliseconds (0 means no time limit). If it
+// stops inside a loop, the state is rolled back to the entry of the
+// outermost one: a residual program resuming mid-loop would have to jump
+// into nested loops, which makes its control flow irreducible.
+template <typename cell>
+inline void evaluate_cells(const std::vector<instruction>& program, const size_t tape_size, const uint64_t step_limit,
+                           const uint32_t time_limit_ms, evaluation_state& state)
+{
+    state.ptr = 0;
+    state.pc = 0;
+    state.steps = 0;
+    state.output.clear();
+    state.finished = false;
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(time_limit_ms);
+    std::vector<cell> cells(tape_size);
+    cell* const tape = cells.data();
+    const int32_t size = static_cast<int32_t>(tape_size);
+    int32_t ptr = 0;
+    size_t pc = 0;
+    uint64_t steps = 0;
+
+    // Loops entered and not left yet, the highest cell reached, and the
+    // state when the outermost loop was entered, with the cells up to the
+    // highest one reached then
+    size_t depth = 0;
+    int32_t high = 0;
+    std::vector<cell> saved_cells;
+    int32_t saved_ptr = 0;
+    size_t saved_pc = 0, saved_output = 0;
+    uint64_t saved_steps = 0;
+
+    for (;; ++pc, ++steps)
+    {
+        if (steps >= step_limit)
+            break;
+        if (time_limit_ms && (steps & 0xFFFF) == 0 && std::chrono::steady_clock::now() >= deadline)
+            break;
+
+        const instruction& ins = program[pc];
+
+        switch (ins.op)
+        {
+            case OP_ADD:
+                tape[ptr] += static_cast<cell>(ins.arg);
+                continue;
+            case OP_MOVE:
+                if (ptr + ins.arg < 0 || ptr + ins.arg >= size)
+                    break;
+                ptr += ins.arg;
+                high = std::max(high, ptr);
+                continue;
+            case OP_OUT:
+                state.output.push_back(static_cast<char>(tape[ptr]));
+                continue;
+            case OP_IN:
+                break;
+            case OP_JZ:
+                if (!tape[ptr])
+                    pc = static_cast<size_t>(ins.arg);
+                else if (!depth++)
+                {
+                    saved_cells.assign(tape, tape + high + 1);
+                    saved_ptr = ptr;
+                    saved_pc = pc;
+                    saved_output = state.output.size();
+                    saved_steps = steps;
+                }
+                continue;
+            case OP_JNZ:
+                if (tape[ptr])
+                    pc = static_cast<size_t>(ins.arg);
+                else
+                    --depth;
+                continue;
+            case OP_CLEAR:
+                tape[ptr] = 0;
+                continue;
+            case OP_SET:
+                tape[ptr] = static_cast<cell>(ins.arg);
+                continue;
+            case OP_PUT:
+                state.output.push_back(static_cast<char>(ins.arg));
+                continue;
+            case OP_CHECK:
+            case OP_CHECK_LOOP:
+                continue;
+            case OP_MUL:
+                if (ptr + ins.offset < 0 || ptr + ins.offset >= size)
+                    break;
+                tape[ptr + ins.offset] += multiply_cell(tape[ptr], ins.arg);
+                high = std::max(high, ptr + ins.offset);
+                continue;
+            case OP_SCAN:
+            {
+                cell* const found = ins.arg > 0 ? scan_right(tape + ptr, ins.arg, tape + size) : scan_left(tape + ptr, -ins.arg, tape);
+                if (found < tape || found >= tape + size)
+                    break;
+                ptr = static_cast<int32_t>(found - tape);
+                high = std::max(high, ptr);
+                continue;
+            }
+            case OP_END:
+                state.finished = true;
+                break;
+        }
+        break;
+    }
+
+    if (depth)
+    {
+        std::fill(cells.begin(), cells.end(), cell(0));
+        std::copy(saved_cells.begin(), saved_cells.end(), cells.begin());
+        ptr = saved_ptr;
+        pc = saved_pc;
+        state.output.resize(saved_output);
+        steps = saved_steps;
+    }
+
+    state.tape.assign(cells.begin(), cells.end());
+    state.ptr = ptr;
+    state.pc = pc;
+    state.steps = steps;
+}
+
+// evaluate_cells for cells of cell_bits bits (8, 16, 32 or 64), tape_size cells
+inline void partial_evaluate(const std::vector<instruction>& program, const unsigned cell_bits, const size_t tape_size,
+                             const uint64_t step_limit, const uint32_t time_limit_ms, evaluation_state& state)
+{
+    switch (cell_bits)
+    {
+        case 16:
+            evaluate_cells<uint16_t>(program, tape_size, step_limit, time_limit_ms, state);
+            break;
+        case 32:
+            evaluate_cells<uint32_t>(program, tape_size, step_limit, time_limit_ms, state);
+            break;
+        case 64:
+            evaluate_cells<uint64_t>(program, tape_size, step_limit, time_limit_ms, state);
+            break;
+        default:
+            evaluate_cells<uint8_t>(program, tape_size, step_limit, time_limit_ms, state);
+            break;
+    }
+}
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "bf_io.hpp"
+#include "bf_ir.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BF_JIT_SUPPORTED
+#endif
+
+// Generated code is called as entry(tape, out, in) and keeps the tape pointer
+// in rbx, the output buffer in r12 and the input reader in r13
+typedef void (*jit_entry)(uint8_t* tape, output_buffer* out, input_reader* in);
+
+// Compiled loops are called as ptr = entry(ptr, out, in)
+typedef uint8_t* (*jit_loop_entry)(uint8_t* ptr, output_buffer* out, input_reader* in);
+
+struct jit_code
+{
+    void* memory;
+    size_t size;
+};
+
+inline void jit_output(output_buffer* out, const int chr)
+{
+    put_output(*out, static_cast<uint8_t>(chr));
+}
+
+inline void jit_input(input_reader* in, uint8_t* cell)
+{
+    read_cell(*in, *cell);
+}
+
+inline void jit_emit(std::vector<uint8_t>& code, std::initializer_list<uint8_t> bytes)
+{
+    code.insert(code.end(), bytes);
+}
+
+inline void jit_emit32(std::vector<uint8_t>& code, const uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        code.push_back(static_cast<uint8_t>(value >> (i * 8)));
+}
+
+inline void jit_emit64(std::vector<uint8_t>& code, const uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        code.push_back(static_cast<uint8_t>(value >> (i * 8)));
+}
+
+inline void jit_patch32(std::vector<uint8_t>& code, const size_t at, const uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        code[at + i] = static_cast<uint8_t>(value >> (i * 8));
+}
+
+// mov rax, imm64; call rax
+inline void jit_emit_call(std::vector<uint8_t>& code, const void* function)
+{
+    jit_emit(code, { 0x48, 0xB8 });
+    jit_emit64(code, reinterpret_cast<uint64_t>(function));
+    jit_emit(code, { 0xFF, 0xD0 });
+}
+
+// add rbx, imm
+inline void jit_emit_move(std::vector<uint8_t>& code, const int32_t distance)
+{
+    if (distance >= -128 && distance <= 127)
+    {
+        jit_emit(code, { 0x48, 0x83, 0xC3, static_cast<uint8_t>(distance) });
+    }
+    else
+    {
+        jit_emit(code, { 0x48, 0x81, 0xC3 });
+        jit_emit32(code, static_cast<uint32_t>(distance));
+    }
+}
+
+// The ModRM byte, and the displacement if any, of an operand [rbx + shift]
+// with reg in the reg field
+inline void jit_emit_cell(std::vector<uint8_t>& code, const uint8_t reg, const int32_t shift)
+{
+    if (!shift)
+    {
+        jit_emit(code, { static_cast<uint8_t>(reg << 3 | 0x03) });
+    }
+    else if (shift >= -128 && shift <= 127)
+    {
+        jit_emit(code, { static_cast<uint8_t>(0x40 | reg << 3 | 0x03), static_cast<uint8_t>(shift) });
+    }
+    else
+    {
+        jit_emit(code, { static_cast<uint8_t>(0x80 | reg << 3 | 0x03) });
+        jit_emit32(code, static_cast<uint32_t>(shift));
+    }
+}
+
+// Brings rbx up to the cell the code is working on, needed wherever control
+// flow meets or rbx itself is used
+inline void jit_emit_shift(std::vector<uint8_t>& code, int32_t& shift)
+{
+    if (shift)
+        jit_emit_move(code, shift);
+    shift = 0;
+}
+
+// Whether a displacement fits a 32-bit operand
+inline bool jit_in_reach(const int64_t shift)
+{
+    return shift >= INT32_MIN && shift <= INT32_MAX;
+}
+
+// Emits the x86-64 code for the instructions that work on the tape alone
+// (pointer in rbx, rax is scratch), shared by the JIT and the ELF backend.
+// Returns false for I/O and OP_END, which every backend handles itself.
+// Within straight-line code > and < only add to shift, the distance of the
+// current cell from rbx, and cells are addressed as [rbx + shift]; rbx
+// catches up at every loop edge and scan.
+inline bool jit_emit_tape_instruction(std::vector<uint8_t>& code, const instruction& ins, std::vector<size_t>& loop_stack, int32_t& shift)
+{
+    switch (ins.op)
+    {
+        case OP_ADD:
+            // add byte [rbx + shift], imm8
+            jit_emit(code, { 0x80 });
+            jit_emit_cell(code, 0, shift);
+            jit_emit(code, { static_cast<uint8_t>(ins.arg) });
+            return true;
+        case OP_MOVE:
+            if (!jit_in_reach(static_cast<int64_t>(shift) + ins.arg))
+                jit_emit_shift(code, shift);
+            shift += ins.arg;
+            return true;
+        case OP_JZ:
+            // cmp byte [rbx], 0; je <after matching ]>
+            jit_emit_shift(code, shift);
+            jit_emit(code, { 0x80, 0x3B, 0x00, 0x0F, 0x84 });
+            jit_emit32(code, 0);
+            loop_stack.push_back(code.size());
+            return true;
+        case OP_JNZ:
+        {
+            const size_t body = loop_stack.back();
+            loop_stack.pop_back();
+
+            // cmp byte [rbx], 0; jne <loop body>
+            jit_emit_shift(code, shift);
+            jit_emit(code, { 0x80, 0x3B, 0x00, 0x0F, 0x85 });
+            jit_emit32(code, static_cast<uint32_t>(body - (code.size() + 4)));
+            jit_patch32(code, body - 4, static_cast<uint32_t>(code.size() - body));
+            return true;
+        }
+        case OP_CLEAR:
+        case OP_SET:
+            // mov byte [rbx + shift], imm8
+            jit_emit(code, { 0xC6 });
+            jit_emit_cell(code, 0, shift);
+            jit_emit(code, { static_cast<uint8_t>(ins.op == OP_SET ? ins.arg : 0) });
+            return true;
+        case OP_MUL:
+            // movzx eax, byte [rbx + shift]; imul eax, eax, imm32; add byte [rbx + shift + offset], al
+            if (!jit_in_reach(static_cast<int64_t>(shift) + ins.offset))
+                jit_emit_shift(code, shift);
+            jit_emit(code, { 0x0F, 0xB6 });
+            jit_emit_cell(code, 0, shift);
+            if (ins.arg != 1)
+            {
+                jit_emit(code, { 0x69, 0xC0 });
+                jit_emit32(code, static_cast<uint32_t>(ins.arg));
+            }
+            jit_emit(code, { 0x00 });
+            jit_emit_cell(code, 0, shift + ins.offset);
+            return true;
+        case OP_SCAN:
+        {
+            // loop: cmp byte [rbx], 0; je done; add rbx, arg; jmp loop; done:
+            jit_emit_shift(code, shift);
+            const size_t start = code.size();
+            jit_emit(code, { 0x80, 0x3B, 0x00, 0x74, 0x00 });
+            const size_t skip = code.size();
+            jit_emit_move(code, ins.arg);
+            jit_emit(code, { 0xEB, static_cast<uint8_t>(start - (code.size() + 2)) });
+            code[skip - 1] = static_cast<uint8_t>(code.size() - skip);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// push rbx; push r12; push r13; sub rsp, 32 (keeps the stack 16-byte aligned
+// and provides the Win64 shadow space); then move the three arguments into
+// rbx, r12 and r13
+inline void jit_emit_prologue(std::vector<uint8_t>& code)
+{
+    jit_emit(code, { 0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0x83, 0xEC, 0x20 });
+#ifdef _WIN32
+    jit_emit(code, { 0x48, 0x89, 0xCB, 0x49, 0x89, 0xD4, 0x4D, 0x89, 0xC5 });
+#else
+    jit_emit(code, { 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD5 });
+#endif
+}
+
+// add rsp, 32; pop r13; pop r12; pop rbx; ret
+inline void jit_emit_epilogue(std::vector<uint8_t>& code)
+{
+    jit_emit(code, { 0x48, 0x83, 0xC4, 0x20, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });
+}
+
+// Translates program[begin, end) into x86-64 machine code, OP_END returns
+inline void jit_emit_range(const std::vector<instruction>& program, const size_t begin, const size_t end, std::vector<uint8_t>& code)
+{
+    std::vector<size_t> loop_stack;
+    int32_t shift = 0;
+
+    for (size_t i = begin; i < end; ++i)
+    {
+        const instruction& ins = program[i];
+        if (jit_emit_tape_instruction(code, ins, loop_stack, shift))
+            continue;
+
+        switch (ins.op)
+        {
+            case OP_OUT:
+                // mov <first argument>, r12; movzx <second argument>, byte [rbx + shift]
+#ifdef _WIN32
+                jit_emit(code, { 0x4C, 0x89, 0xE1, 0x0F, 0xB6 });
+                jit_emit_cell(code, 2, shift);
+#else
+                jit_emit(code, { 0x4C, 0x89, 0xE7, 0x0F, 0xB6 });
+                jit_emit_cell(code, 6, shift);
+#endif
+                jit_emit_call(code, reinterpret_cast<const void*>(&jit_output));
+                break;
+            case OP_PUT:
+                // mov <first argument>, r12; mov <second argument>, imm32
+#ifdef _WIN32
+                jit_emit(code, { 0x4C, 0x89, 0xE1, 0xBA });
+#else
+                jit_emit(code, { 0x4C, 0x89, 0xE7, 0xBE });
+#endif
+                jit_emit32(code, static_cast<uint8_t>(ins.arg));
+                jit_emit_call(code, reinterpret_cast<const void*>(&jit_output));
+                break;
+            case OP_IN:
+                // mov <first argument>, r13; lea <second argument>, [rbx + shift]
+#ifdef _WIN32
+                jit_emit(code, { 0x4C, 0x89, 0xE9, 0x48, 0x8D });
+                jit_emit_cell(code, 2, shift);
+#else
+                jit_emit(code, { 0x4C, 0x89, 0xEF, 0x48, 0x8D });
+                jit_emit_cell(code, 6, shift);
+#endif
+                jit_emit_call(code, reinterpret_cast<const void*>(&jit_input));
+                break;
+            case OP_END:
+                jit_emit_epilogue(code);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Translates the program into x86-64 machine code
+inline void jit_generate(const std::vector<instruction>& program, std::vector<uint8_t>& code)
+{
+    jit_emit_prologue(code);
+    jit_emit_range(program, 0, program.size(), code);
+}
+
+// Translates the loop whose OP_JZ is at open into a function that runs it to
+// completion from its test on and returns the pointer it ends on
+inline void jit_generate_loop(const std::vector<instruction>& program, const size_t open, std::vector<uint8_t>& code)
+{
+    jit_emit_prologue(code);
+    jit_emit_range(program, open, static_cast<size_t>(program[open].arg) + 1, code);
+
+    // mov rax, rbx
+    jit_emit(code, { 0x48, 0x89, 0xD8 });
+    jit_emit_epilogue(code);
+}
+
+// Copies generated code into a freshly mapped region and makes it
+// executable, never writable and executable at the same time
+inline bool jit_load(const std::vector<uint8_t>& code, jit_code& out)
+{
+    out.size = code.size();
+
+#ifdef _WIN32
+    out.memory = VirtualAlloc(nullptr, out.size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!out.memory)
+        return false;
+
+    memcpy(out.memory, code.data(), out.size);
+
+    DWORD old_protection;
+    if (!VirtualProtect(out.memory, out.size, PAGE_EXECUTE_READ, &old_protection))
+    {
+        VirtualFree(out.memory, 0, MEM_RELEASE);
+        return false;
+    }
+#else
+    out.memory = mmap(nullptr, out.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (out.memory == MAP_FAILED)
+        return false;
+
+    memcpy(out.memory, code.data(), out.size);
+
+    if (mprotect(out.memory, out.size, PROT_READ | PROT_EXEC))
+    {
+        munmap(out.memory, out.size);
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+inline bool jit_compile(const std::vector<instruction>& program, jit_code& out)
+{
+    std::vector<uint8_t> code;
+    jit_generate(program, code);
+    return jit_load(code, out);
+}
+
+inline bool jit_compile_loop(const std::vector<instruction>& program, const size_t open, jit_code& out)
+{
+    std::vector<uint8_t> code;
+    jit_generate_loop(program, open, code);
+    return jit_load(code, out);
+}
+
+inline jit_entry jit_function(const jit_code& code)
+{
+    return reinterpret_cast<jit_entry>(code.memory);
+}
+
+inline jit_loop_entry jit_loop_function(const jit_code& code)
+{
+    return reinterpret_cast<jit_loop_entry>(code.memory);
+}
+
+inline void jit_free(jit_code& code)
+{
+#ifdef _WIN32
+    VirtualFree(code.memory, 0, MEM_RELEASE);
+#else
+    munmap(code.memory, code.size);
+#endif
+    code.memory = nullptr;
+}
@@ -0,0 +1,641 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#ifndef _WIN32
+#include <setjmp.h>
+#endif
+
+#include "bf_fused.hpp"
+#include "bf_io.hpp"
+#include "bf_ir.hpp"
+#include "bf_jit.hpp"
+#include "bf_profile.hpp"
+#include "bf_scan.hpp"
+#include "bf_tape.hpp"
+
+// libbf, the interpreter as a library. A bf_program is parsed and optimized
+// once and can be run any number of times; a bf_instance owns a tape, the
+// I/O buffers and a step limit, and runs programs one after another with
+// bf_reset in between, reusing all of its memory. bf_interpreter and
+// bf_compiler -jit are built on it.
+
+enum bf_status : uint8_t
+{
+    BF_FINISHED,
+    BF_STEP_LIMIT,  // stopped after the instance's step limit
+    BF_TAPE_ERROR   // left the tape, could not grow it or the snapshot does not fit, the reason went to stderr (on Windows
+                    // leaving the tape ends the process)
+};
+
+// OP_CHECK: ends the run the way a fault in a guard region would, unless
+// ptr[low] through ptr[high] are all on the tape
+template <typename cell>
+inline void check_cells(const tape_region& tape, const cell* ptr, const int32_t low, const int32_t high)
+{
+    const cell* const begin = reinterpret_cast<const cell*>(tape.cells);
+    const ptrdiff_t at = ptr - begin;
+    if (at + low < 0)
+        tape_error(tape, "Error: The program moved left of the first cell\n");
+    if (at + high >= reinterpret_cast<const cell*>(tape.end) - begin)
+        tape_error(tape, "Error: The program ran past the end of the tape, give it a larger tape size\n");
+}
+
+// OP_SCAN: moves ptr by stride until it lands on a zero cell. Like the
+// unscanned loop reading a guard region, running off the tape first ends the
+// run with a tape error
+template <typename cell>
+inline cell* scan_cells(const tape_region& tape, cell* ptr, const int32_t stride)
+{
+    if (stride > 0)
+    {
+        cell* const end = reinterpret_cast<cell*>(tape.end);
+        ptr = scan_right(ptr, stride, end);
+        if (ptr >= end)
+            tape_error(tape, "Error: The program ran past the end of the tape, give it a larger tape size\n");
+    }
+    else
+    {
+        cell* const begin = reinterpret_cast<cell*>(tape.cells);
+        ptr = scan_left(ptr, -stride, begin);
+        if (ptr < begin)
+            tape_error(tape, "Error: The program moved left of the first cell\n");
+    }
+    return ptr;
+}
+
+// Portable switch-based engine over cells of type cell, starting at
+// instruction entry with the pointer on cell entry_cell (both 0 unless the
+// program was loaded with a snapshot). With profiling set (for --count and
+// --profile) it also counts every instruction and every jump back into
+// profile, with limited set it stops after step_limit instructions.
+template <typename cell, bool profiling, bool limited>
+inline bf_status execute_switch(const std::vector<instruction>& program, const size_t entry, const size_t entry_cell, const tape_region& tape,
+                                output_buffer& out, input_reader& in, execution_profile* profile, uint64_t step_limit)
+{
+    cell* const begin = reinterpret_cast<cell*>(tape.cells);
+    cell* ptr = begin + entry_cell;
+    const instruction* const base = program.data();
+
+    for (const instruction* pc = base + entry;; ++pc)
+    {
+        if (profiling)
+            ++profile->counts[pc - base];
+        if (limited && !step_limit--)
+            return BF_STEP_LIMIT;
+
+        switch (pc->op)
+        {
+            case OP_ADD:
+                *ptr += static_cast<cell>(pc->arg);
+                break;
+            case OP_MOVE:
+                ptr += pc->arg;
+                break;
+            case OP_OUT:
+                put_output(out, static_cast<uint8_t>(*ptr));
+                break;
+            case OP_IN:
+                read_cell(in, *ptr);
+                break;
+            case OP_JZ:
+                if (!*ptr)
+                    pc = base + pc->arg;
+                break;
+            case OP_JNZ:
+                if (*ptr)
+                {
+                    if (profiling)
+                        ++profile->taken[pc - base];
+                    pc = base + pc->arg;
+                }
+                break;
+            case OP_CLEAR:
+                *ptr = 0;
+                break;
+            case OP_MUL:
+                ptr[pc->offset] += multiply_cell(*ptr, pc->arg);
+                break;
+            case OP_SCAN:
+                ptr = scan_cells(tape, ptr, pc->arg);
+                break;
+            case OP_SET:
+                *ptr = static_cast<cell>(pc->arg);
+                break;
+            case OP_PUT:
+                put_output(out, static_cast<uint8_t>(pc->arg));
+                break;
+            case OP_CHECK:
+                check_cells(tape, ptr, pc->arg, pc->offset);
+                break;
+            case OP_CHECK_LOOP:
+                if (*ptr)
+                    check_cells(tape, ptr, pc->arg, pc->offset);
+                break;
+            case OP_END:
+                return BF_FINISHED;
+        }
+    }
+}
+
+// An instruction of the threaded engine: the address of its handler and its
+// operands
+struct threaded_instruction
+{
+    const void* handler;
+    int32_t arg;
+    int32_t offset;
+};
+
+// Computed-goto dispatch needs the GNU labels-as-values extension, build with
+// -DBF_DISPATCH_SWITCH to force the portable switch-based loop instead
+#if defined(__GNUC__) && !defined(BF_DISPATCH_SWITCH)
+#define BF_THREADED_DISPATCH
+#endif
+
+#ifdef BF_THREADED_DISPATCH
+
+// What each instruction with at most one operand does, the parts the
+// superinstructions of bf_fused.hpp are put together from
+#define BF_DO_OP_ADD(operand) *ptr += static_cast<cell>(operand);
+#define BF_DO_OP_MOVE(operand) ptr += (operand);
+#define BF_DO_OP_OUT(operand) put_output(out, static_cast<uint8_t>(*ptr));
+#define BF_DO_OP_IN(operand) read_cell(in, *ptr);
+#define BF_DO_OP_JZ(operand) if (!*ptr) { pc = base + (operand); NEXT(); }
+#define BF_DO_OP_JNZ(operand) if (*ptr) { pc = base + (operand); NEXT(); }
+#define BF_DO_OP_CLEAR(operand) *ptr = 0;
+#define BF_DO_OP_SCAN(operand) ptr = scan_cells(tape, ptr, (operand));
+#define BF_DO_OP_SET(operand) *ptr = static_cast<cell>(operand);
+#define BF_DO_OP_PUT(operand) put_output(out, static_cast<uint8_t>(operand));
+
+// Direct-threaded engine: every instruction carries the address of its
+// handler, so each handler jumps straight to the next one. An instruction
+// followed by one it is fused with (bf_fused.hpp) gets a superinstruction
+// that does both, with the second one's arg as its offset, and skips the
+// second, which stays in place for jumps that land on it. The threaded copy
+// of the program goes to code, which the caller keeps: a tape error leaves
+// with siglongjmp and runs no destructors.
+template <typename cell>
+inline void execute(const std::vector<instruction>& program, const size_t entry, const size_t entry_cell, const tape_region& tape,
+                    output_buffer& out, input_reader& in, std::vector<threaded_instruction>& code)
+{
+    // Indexed by op_code, keep in the same order
+    static const void* const handlers[] =
+    {
+        &&do_add, &&do_move, &&do_out, &&do_in, &&do_jz, &&do_jnz,
+        &&do_clear, &&do_mul, &&do_scan, &&do_set, &&do_put, &&do_check, &&do_check_loop, &&do_end
+    };
+
+    const void* fused[OP_END + 1][OP_END + 1] = {};
+#define FUSED_ENTRY(first, second) fused[first][second] = &&do_##first##_##second;
+    BF_FUSED_PAIRS(FUSED_ENTRY)
+#undef FUSED_ENTRY
+
+    code.resize(program.size());
+
+    for (size_t i = 0; i < program.size(); ++i)
+    {
+        const void* const pair = i + 1 < program.size() ? fused[program[i].op][program[i + 1].op] : nullptr;
+        if (pair)
+            code[i] = { pair, program[i].arg, program[i + 1].arg };
+        else
+            code[i] = { handlers[program[i].op], program[i].arg, program[i].offset };
+    }
+
+    cell* const begin = reinterpret_cast<cell*>(tape.cells);
+    cell* ptr = begin + entry_cell;
+    const threaded_instruction* const base = code.data();
+    const threaded_instruction* pc = base + entry;
+
+#define DISPATCH() goto *pc->handler
+#define NEXT() do { ++pc; DISPATCH(); } while (0)
+
+    DISPATCH();
+
+do_add:
+    *ptr += static_cast<cell>(pc->arg);
+    NEXT();
+do_move:
+    ptr += pc->arg;
+    NEXT();
+do_out:
+    put_output(out, static_cast<uint8_t>(*ptr));
+    NEXT();
+do_in:
+    read_cell(in, *ptr);
+    NEXT();
+do_jz:
+    if (!*ptr)
+        pc = base + pc->arg;
+    NEXT();
+do_jnz:
+    if (*ptr)
+        pc = base + pc->arg;
+    NEXT();
+do_clear:
+    *ptr = 0;
+    NEXT();
+do_mul:
+    ptr[pc->offset] += multiply_cell(*ptr, pc->arg);
+    NEXT();
+do_scan:
+    ptr = scan_cells(tape, ptr, pc->arg);
+    NEXT();
+do_set:
+    *ptr = static_cast<cell>(pc->arg);
+    NEXT();
+do_put:
+    put_output(out, static_cast<uint8_t>(pc->arg));
+    NEXT();
+do_check:
+    check_cells(tape, ptr, pc->arg, pc->offset);
+    NEXT();
+do_check_loop:
+    if (*ptr)
+        check_cells(tape, ptr, pc->arg, pc->offset);
+    NEXT();
+do_end:
+    return;
+
+#define FUSED_HANDLER(first, second) \
+do_##first##_##second: \
+    BF_DO_##first(pc->arg) \
+    BF_DO_##second(pc->offset) \
+    pc += 2; \
+    DISPATCH();
+    BF_FUSED_PAIRS(FUSED_HANDLER)
+#undef FUSED_HANDLER
+
+#undef NEXT
+#undef DISPATCH
+}
+
+#undef BF_DO_OP_ADD
+#undef BF_DO_OP_MOVE
+#undef BF_DO_OP_OUT
+#undef BF_DO_OP_IN
+#undef BF_DO_OP_JZ
+#undef BF_DO_OP_JNZ
+#undef BF_DO_OP_CLEAR
+#undef BF_DO_OP_SCAN
+#undef BF_DO_OP_SET
+#undef BF_DO_OP_PUT
+
+#else
+
+template <typename cell>
+inline void execute(const std::vector<instruction>& program, const size_t entry, const size_t entry_cell, const tape_region& tape,
+                    output_buffer& out, input_reader& in, std::vector<threaded_instruction>&)
+{
+    execute_switch<cell, false, false>(program, entry, entry_cell, tape, out, in, nullptr, 0);
+}
+
+#endif
+
+// Runs the program on the engine for its cell width: the threaded one, with
+// its copy of the program in code, or the switch-based one when there is a
+// profile to fill or a step limit (0 for none)
+template <typename cell>
+inline bf_status run_program(const std::vector<instruction>& program, const size_t entry, const size_t entry_cell, const tape_region& tape,
+                             output_buffer& out, input_reader& in, execution_profile* profile, const uint64_t step_limit,
+                             std::vector<threaded_instruction>& code)
+{
+    if (profile && step_limit)
+        return execute_switch<cell, true, true>(program, entry, entry_cell, tape, out, in, profile, step_limit);
+    if (profile)
+        return execute_switch<cell, true, false>(program, entry, entry_cell, tape, out, in, profile, 0);
+    if (step_limit)
+        return execute_switch<cell, false, true>(program, entry, entry_cell, tape, out, in, nullptr, step_limit);
+    execute<cell>(program, entry, entry_cell, tape, out, in, code);
+    return BF_FINISHED;
+}
+
+#define DEFAULT_TIER_THRESHOLD 1000
+
+#ifdef BF_JIT_SUPPORTED
+
+// Tiered engine for 8-bit cells: interprets from the start and counts the
+// jumps back of every loop. A loop that jumps back threshold times in one run
+// is translated to machine code on the spot and the run switches to it at
+// that jump, which leaves the pointer right before the loop's test, and at
+// every later [ of that loop. Loops enclosing a compiled one are compiled
+// whole once they get hot themselves. The machine code goes to loops, the
+// jumps back so far at every OP_JNZ to heat and the machine code at every
+// compiled OP_JZ to compiled, all kept by the caller: a tape error leaves
+// with siglongjmp and runs no destructors.
+inline void execute_tiered(const std::vector<instruction>& program, const size_t entry, const size_t entry_cell, const tape_region& tape,
+                           output_buffer& out, input_reader& in, const uint32_t threshold, std::vector<jit_code>& loops,
+                           std::vector<uint32_t>& heat, std::vector<jit_loop_entry>& compiled)
+{
+    uint8_t* const begin = tape.cells;
+    uint8_t* ptr = begin + entry_cell;
+    const instruction* const base = program.data();
+
+    heat.assign(program.size(), 0);
+    compiled.assign(program.size(), nullptr);
+
+    for (const instruction* pc = base + entry;; ++pc)
+    {
+        switch (pc->op)
+        {
+            case OP_ADD:
+                *ptr += static_cast<uint8_t>(pc->arg);
+                break;
+            case OP_MOVE:
+                ptr += pc->arg;
+                break;
+            case OP_OUT:
+                put_output(out, *ptr);
+                break;
+            case OP_IN:
+                read_cell(in, *ptr);
+                break;
+            case OP_JZ:
+                if (!*ptr)
+                    pc = base + pc->arg;
+                else if (const jit_loop_entry loop = compiled[pc - base])
+                {
+                    ptr = loop(ptr, &out, &in);
+                    pc = base + pc->arg;
+                }
+                break;
+            case OP_JNZ:
+                if (*ptr)
+                {
+                    const size_t open = static_cast<size_t>(pc->arg);
+                    jit_code code;
+                    if (++heat[pc - base] == threshold && jit_compile_loop(program, open, code))
+                    {
+                        loops.push_back(code);
+                        compiled[open] = jit_loop_function(code);
+                    }
+
+                    // On-stack replacement: the compiled loop picks up at its test
+                    if (compiled[open])
+                        ptr = compiled[open](ptr, &out, &in);
+                    else
+                        pc = base + open;
+                }
+                break;
+            case OP_CLEAR:
+                *ptr = 0;
+                break;
+            case OP_MUL:
+                ptr[pc->offset] += multiply_cell(*ptr, pc->arg);
+                break;
+            case OP_SCAN:
+                ptr = scan_cells(tape, ptr, pc->arg);
+                break;
+            case OP_SET:
+                *ptr = static_cast<uint8_t>(pc->arg);
+                break;
+            case OP_PUT:
+                put_output(out, static_cast<uint8_t>(pc->arg));
+                break;
+            case OP_CHECK:
+                check_cells(tape, ptr, pc->arg, pc->offset);
+                break;
+            case OP_CHECK_LOOP:
+                if (*ptr)
+                    check_cells(tape, ptr, pc->arg, pc->offset);
+                break;
+            case OP_END:
+                return;
+        }
+    }
+}
+
+#endif
+
+// A program ready to run: the optimized instruction stream and, if asked for,
+// its x86-64 translation. Programs loaded from bytecode (bf_bytecode.hpp) may
+// carry a snapshot of compile-time evaluation instead: a run then prints
+// output, starts from tape and resumes at instruction entry with the pointer
+// on cell entry_cell.
+struct bf_program
+{
+    std::vector<instruction> code;
+    std::vector<uint32_t> offsets;  // source offset of every instruction, with BF_KEEP_OFFSETS
+    jit_code machine_code;          // with BF_COMPILE_JIT, memory is null otherwise
+    unsigned cell_bits = 0;         // width the snapshot was taken at, 0 for none (the program runs at any width)
+    size_t entry = 0, entry_cell = 0;
+    std::vector<uint8_t> output, tape;
+    bool checked = false;           // checks its own tape accesses (BF_CHECKED), never runs as machine code
+};
+
+#define BF_KEEP_OFFSETS 1u      // fill offsets, for profiles
+#define BF_COMPILE_JIT 2u       // also translate to machine code, 8-bit cells on x86-64 only
+#define BF_CHECKED 4u           // check tape bounds in the program itself (see insert_bounds_checks), overrides BF_COMPILE_JIT
+
+// Parses and optimizes length bytes of source into program, prints the reason
+// and returns false on failure
+inline bool bf_compile(const char* source, const size_t length, bf_program& program, const unsigned flags = 0)
+{
+    std::vector<uint32_t>* const offsets = flags & BF_KEEP_OFFSETS ? &program.offsets : nullptr;
+    program.code.clear();
+    program.offsets.clear();
+    program.machine_code = { nullptr, 0 };
+    program.cell_bits = 0;
+    program.entry = program.entry_cell = 0;
+    program.output.clear();
+    program.tape.clear();
+    program.checked = (flags & BF_CHECKED) != 0;
+
+    if (!parse_program(source, length, program.code, offsets))
+        return false;
+    optimize_loops(program.code, offsets);
+    if (program.checked)
+        insert_bounds_checks(program.code, offsets);
+
+#ifdef BF_JIT_SUPPORTED
+    if ((flags & BF_COMPILE_JIT) && !program.checked && !jit_compile(program.code, program.machine_code))
+    {
+        perror("Error allocating executable memory");
+        program.machine_code = { nullptr, 0 };
+        return false;
+    }
+#endif
+    return true;
+}
+
+inline void bf_free_program(bf_program& program)
+{
+#ifdef BF_JIT_SUPPORTED
+    if (program.machine_code.memory)
+        jit_free(program.machine_code);
+#endif
+    program.code.clear();
+    program.offsets.clear();
+    program.output.clear();
+    program.tape.clear();
+    program.checked = false;
+}
+
+struct bf_instance_options
+{
+    unsigned cell_bits = 8;
+    size_t tape_size = DEFAULT_TAPE_SIZE;
+    size_t output_buffer_size = DEFAULT_OUTPUT_BUFFER_SIZE;
+    eof_policy eof = EOF_MINUS_ONE;
+    uint64_t step_limit = 0;            // instructions per run, 0 for no limit
+    uint32_t tier_threshold = 0;        // with 8-bit cells on x86-64, compile loops that jump back this often, 0 to only interpret
+    const char* input_path = nullptr;   // read input from this file, mapped when possible
+    read_function read = nullptr;       // otherwise from read, or from stdin if that is null too
+    write_function write = nullptr;     // write output here instead of stdout
+    void* io_context = nullptr;         // passed to read and write
+};
+
+// Everything a run needs besides the program. Instances hold on to their
+// addresses (the tape is registered with the fault handler and the input
+// flushes the output), so they must not be moved or copied once open.
+struct bf_instance
+{
+    tape_region tape;
+    output_buffer out;
+    input_reader in;
+    unsigned cell_bits;
+    uint64_t step_limit;
+    uint32_t tier_threshold;
+    std::vector<jit_code> hot_loops;    // compiled by the tiered engine during a run
+
+    // The engines' working copies of the program, here rather than on their
+    // stacks so that a tape error does not leak them
+    std::vector<threaded_instruction> threaded_code;
+    std::vector<uint32_t> loop_heat;
+    std::vector<jit_loop_entry> compiled_loops;
+};
+
+// Opens instance with the given options, prints the reason and returns false
+// on failure
+inline bool bf_open_instance(bf_instance& instance, const bf_instance_options& options)
+{
+    instance.cell_bits = options.cell_bits;
+    instance.step_limit = options.step_limit;
+    instance.tier_threshold = options.tier_threshold;
+    instance.tape = { nullptr, nullptr, nullptr, 0, nullptr };
+
+    init_output(instance.out, options.output_buffer_size, options.write, options.io_context);
+    if (!init_input(instance.in, options.input_path, options.eof, &instance.out, options.read, options.io_context))
+        return false;
+
+    if (!open_tape(instance.tape, options.tape_size))
+    {
+        close_input(instance.in);
+        return false;
+    }
+    return true;
+}
+
+// Picks the engine: the machine code when there is some and nothing needs
+// counting, then the tiered engine if asked for (the machine code of neither
+// checks bounds), otherwise the interpreter for the cell width
+inline bf_status bf_dispatch(bf_instance& instance, const bf_program& program, execution_profile* profile)
+{
+    if (program.machine_code.memory && instance.cell_bits == 8 && !profile && !instance.step_limit)
+    {
+        jit_function(program.machine_code)(instance.tape.cells, &instance.out, &instance.in);
+        return BF_FINISHED;
+    }
+
+#ifdef BF_JIT_SUPPORTED
+    if (instance.tier_threshold && instance.cell_bits == 8 && !profile && !instance.step_limit && !program.checked)
+    {
+        execute_tiered(program.code, program.entry, program.entry_cell, instance.tape, instance.out, instance.in, instance.tier_threshold,
+                       instance.hot_loops, instance.loop_heat, instance.compiled_loops);
+        return BF_FINISHED;
+    }
+#endif
+
+    switch (instance.cell_bits)
+    {
+        case 16:
+            return run_program<uint16_t>(program.code, program.entry, program.entry_cell, instance.tape, instance.out, instance.in, profile,
+                                     instance.step_limit, instance.threaded_code);
+        case 32:
+            return run_program<uint32_t>(program.code, program.entry, program.entry_cell, instance.tape, instance.out, instance.in, profile,
+                                     instance.step_limit, instance.threaded_code);
+        case 64:
+            return run_program<uint64_t>(program.code, program.entry, program.entry_cell, instance.tape, instance.out, instance.in, profile,
+                                     instance.step_limit, instance.threaded_code);
+        default:
+            return run_program<uint8_t>(program.code, program.entry, program.entry_cell, instance.tape, instance.out, instance.in, profile,
+                                     instance.step_limit, instance.threaded_code);
+    }
+}
+
+// Frees the loops the tiered engine compiled, they belong to one program
+inline void free_hot_loops(bf_instance& instance)
+{
+#ifdef BF_JIT_SUPPORTED
+    for (jit_code& code : instance.hot_loops)
+        jit_free(code);
+#endif
+    instance.hot_loops.clear();
+}
+
+// Runs program on a fresh instance (or one that was just reset), filling
+// profile if given; the output is flushed whatever the outcome
+inline bf_status bf_run(bf_instance& instance, const bf_program& program, execution_profile* profile = nullptr)
+{
+    // A snapshot is only good for the width it was taken at
+    if (program.cell_bits && program.cell_bits != instance.cell_bits)
+    {
+        fprintf(stderr, "Error: The program was compiled for %u-bit cells\n", program.cell_bits);
+        return BF_TAPE_ERROR;
+    }
+
+    const size_t tape_bytes = static_cast<size_t>(instance.tape.end - instance.tape.cells);
+    if (program.cell_bits && (program.tape.size() > tape_bytes || program.entry_cell >= tape_bytes / (program.cell_bits / 8)))
+    {
+        fprintf(stderr, "Error: The program's snapshot does not fit on the tape, give it a larger tape size\n");
+        return BF_TAPE_ERROR;
+    }
+
+#ifndef _WIN32
+    // A tape error in the fault handler comes back here instead of ending the process
+    sigjmp_buf escape;
+    if (sigsetjmp(escape, 1))
+    {
+        instance.tape.escape = nullptr;
+        free_hot_loops(instance);
+        flush_output(instance.out);
+        return BF_TAPE_ERROR;
+    }
+    instance.tape.escape = &escape;
+#endif
+
+    // A snapshot goes onto the tape like any other write, growing it
+    if (program.cell_bits)
+    {
+        for (const uint8_t chr : program.output)
+            put_output(instance.out, chr);
+        if (!program.tape.empty())
+            memcpy(instance.tape.cells, program.tape.data(), program.tape.size());
+    }
+
+    const bf_status status = bf_dispatch(instance, program, profile);
+
+    instance.tape.escape = nullptr;
+    free_hot_loops(instance);
+    flush_output(instance.out);
+    return status;
+}
+
+// Readies the instance for the next run without giving any memory back: the
+// tape is zeroed, unwritten output dropped and the input started over
+inline void bf_reset(bf_instance& instance)
+{
+    clear_tape(instance.tape);
+    instance.out.cursor = instance.out.storage.data();
+    rewind_input(instance.in);
+}
+
+inline void bf_close_instance(bf_instance& instance)
+{
+    close_tape(instance.tape);
+    close_input(instance.in);
+}
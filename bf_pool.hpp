@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// One worker's share of the jobs
+struct work_queue
+{
+    std::mutex lock;
+    std::deque<size_t> jobs;
+};
+
+// The owner takes jobs from the front of its own queue
+inline bool take_job(work_queue& queue, size_t& job)
+{
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.jobs.empty())
+        return false;
+    job = queue.jobs.front();
+    queue.jobs.pop_front();
+    return true;
+}
+
+// Idle workers steal from the back, away from where the owner works
+inline bool steal_job(work_queue& queue, size_t& job)
+{
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.jobs.empty())
+        return false;
+    job = queue.jobs.back();
+    queue.jobs.pop_back();
+    return true;
+}
+
+// Runs task(0) ... task(count - 1) on up to workers threads (all hardware
+// threads when 0). Every worker starts with a contiguous share of the jobs
+// and, once that runs out, steals from the others until none is left.
+inline void run_parallel(const size_t count, unsigned workers, const std::function<void(size_t)>& task)
+{
+    if (!workers)
+        workers = std::thread::hardware_concurrency();
+    if (workers > count)
+        workers = static_cast<unsigned>(count);
+    if (workers <= 1)
+    {
+        for (size_t job = 0; job < count; ++job)
+            task(job);
+        return;
+    }
+
+    std::vector<work_queue> queues(workers);
+    for (size_t job = 0; job < count; ++job)
+        queues[job * workers / count].jobs.push_back(job);
+
+    std::vector<std::thread> threads;
+    for (unsigned self = 0; self < workers; ++self)
+    {
+        threads.emplace_back([&queues, &task, self, workers]()
+        {
+            size_t job;
+            for (;;)
+            {
+                bool found = take_job(queues[self], job);
+                for (unsigned victim = 1; !found && victim < workers; ++victim)
+                    found = steal_job(queues[(self + victim) % workers], job);
+
+                // Jobs are only ever removed, so nothing left to steal means done
+                if (!found)
+                    return;
+                task(job);
+            }
+        });
+    }
+
+    for (std::thread& thread : threads)
+        thread.join();
+}
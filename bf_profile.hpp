@@ -0,0 +1,332 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <vector>
+
+#include "bf_ir.hpp"
+
+#define PROFILE_REPORT_ROWS 30
+
+// What an instrumented run collects: how often each instruction ran and, for
+// every OP_JNZ, how often it jumped back
+struct execution_profile
+{
+    std::vector<uint64_t> counts;
+    std::vector<uint64_t> taken;
+};
+
+inline void init_profile(execution_profile& profile, const size_t size)
+{
+    profile.counts.assign(size, 0);
+    profile.taken.assign(size, 0);
+}
+
+inline uint64_t profile_total(const execution_profile& profile)
+{
+    uint64_t total = 0;
+    for (const uint64_t count : profile.counts)
+        total += count;
+    return total;
+}
+
+struct source_position
+{
+    uint32_t line, column;
+};
+
+// Turns the offsets from parse_program into 1-based line and column numbers,
+// offsets are in program order so one pass over the source does it
+inline void locate_instructions(const char* source, const std::vector<uint32_t>& offsets, std::vector<source_position>& positions)
+{
+    positions.resize(offsets.size());
+
+    size_t at = 0;
+    source_position position = { 1, 1 };
+    for (size_t i = 0; i < offsets.size(); ++i)
+    {
+        for (; at < offsets[i]; ++at)
+        {
+            if (source[at] == '\n')
+                position = { position.line + 1, 1 };
+            else
+                ++position.column;
+        }
+        positions[i] = position;
+    }
+}
+
+// One loop that survived optimize_loops, from its OP_JZ at open to its OP_JNZ at close
+struct loop_profile
+{
+    size_t open, close;
+    uint64_t entries;       // times the [ was reached
+    uint64_t iterations;    // times the body ran
+    uint64_t inclusive;     // instructions executed inside, nested loops included
+    uint64_t self;          // the same without nested loops
+    bool balanced;          // the pointer ends every iteration where it started
+    bool innermost;
+};
+
+inline void collect_loops(const std::vector<instruction>& program, const execution_profile& profile, std::vector<loop_profile>& loops)
+{
+    std::vector<bool> balanced;
+    find_balanced_loops(program, balanced);
+
+    // Index in loops of every open loop
+    std::vector<size_t> stack;
+
+    for (size_t i = 0; i < program.size(); ++i)
+    {
+        const instruction& ins = program[i];
+
+        if (!stack.empty())
+        {
+            loops[stack.back()].self += profile.counts[i];
+            for (const size_t open : stack)
+                loops[open].inclusive += profile.counts[i];
+        }
+
+        if (ins.op == OP_JZ)
+        {
+            if (!stack.empty())
+                loops[stack.back()].innermost = false;
+            loops.push_back({ i, static_cast<size_t>(ins.arg), profile.counts[i], profile.counts[static_cast<size_t>(ins.arg)],
+                              profile.counts[i], profile.counts[i], balanced[i], true });
+            stack.push_back(loops.size() - 1);
+        }
+        else if (ins.op == OP_JNZ)
+            stack.pop_back();
+    }
+}
+
+inline const char* op_name(const op_code op)
+{
+    static const char* const names[] = { "add", "move", "out", "in", "[", "]", "clear", "mul", "scan", "set", "put", "check", "check[", "end" };
+    return names[op];
+}
+
+// Prints the ranked report: totals, the hottest loops by share of executed
+// instructions and the hottest single instructions
+inline void write_profile_report(FILE* file, const char* name, const std::vector<instruction>& program,
+                                 const std::vector<source_position>& positions, const execution_profile& profile,
+                                 const double seconds)
+{
+    const uint64_t total = profile_total(profile);
+    const double share = total ? 100.0 / static_cast<double>(total) : 0.0;
+
+    std::vector<loop_profile> loops;
+    collect_loops(program, profile, loops);
+    std::sort(loops.begin(), loops.end(), [](const loop_profile& a, const loop_profile& b) { return a.inclusive > b.inclusive; });
+
+    fprintf(file, "Profile of %s: %llu instructions in %.3f s, %zu instructions, %zu loops left after idiom matching\n\n",
+            name, static_cast<unsigned long long>(total), seconds, program.size(), loops.size());
+
+    // Unbalanced loops and loops with nested loops are what the idioms miss
+    fprintf(file, "Hot loops (time share estimated from executed instructions)\n");
+    fprintf(file, "%5s %12s %8s %8s %14s %16s %12s  %s\n", "rank", "line:col", "share", "self", "entries", "iterations", "avg trip", "shape");
+    for (size_t i = 0; i < loops.size() && i < PROFILE_REPORT_ROWS && loops[i].inclusive; ++i)
+    {
+        const loop_profile& loop = loops[i];
+        char where[32];
+        snprintf(where, sizeof(where), "%u:%u", positions[loop.open].line, positions[loop.open].column);
+
+        fprintf(file, "%5zu %12s %7.2f%% %7.2f%% %14llu %16llu %12.1f  %s, %s\n", i + 1, where,
+                static_cast<double>(loop.inclusive) * share, static_cast<double>(loop.self) * share,
+                static_cast<unsigned long long>(loop.entries), static_cast<unsigned long long>(loop.iterations),
+                loop.entries ? static_cast<double>(loop.iterations) / static_cast<double>(loop.entries) : 0.0,
+                loop.balanced ? "balanced" : "unbalanced", loop.innermost ? "innermost" : "nested");
+    }
+
+    std::vector<size_t> order(program.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&profile](const size_t a, const size_t b) { return profile.counts[a] > profile.counts[b]; });
+
+    fprintf(file, "\nHot instructions\n");
+    fprintf(file, "%5s %12s %-6s %8s %16s %8s\n", "rank", "line:col", "op", "arg", "count", "share");
+    for (size_t i = 0; i < order.size() && i < PROFILE_REPORT_ROWS && profile.counts[order[i]]; ++i)
+    {
+        const size_t at = order[i];
+        char where[32];
+        snprintf(where, sizeof(where), "%u:%u", positions[at].line, positions[at].column);
+
+        fprintf(file, "%5zu %12s %-6s %8d %16llu %7.2f%%\n", i + 1, where, op_name(program[at].op),
+                program[at].op == OP_JZ || program[at].op == OP_JNZ ? 0 : program[at].arg,
+                static_cast<unsigned long long>(profile.counts[at]), static_cast<double>(profile.counts[at]) * share);
+    }
+}
+
+// Observed behaviour of one loop, read back from a profile file
+struct loop_counts
+{
+    bool known;
+    uint64_t entries, iterations;
+};
+
+// Identifies the instruction stream a profile was taken from
+inline uint64_t program_fingerprint(const std::vector<instruction>& program)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (const instruction& ins : program)
+    {
+        const int64_t fields[] = { ins.op, ins.arg, ins.offset };
+        for (const int64_t field : fields)
+            hash = (hash ^ static_cast<uint64_t>(field)) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// Writes the entry and iteration counts of every loop, keyed by the source
+// offset of its [, for bf_compiler -fprofile-use
+inline bool write_loop_profile(const char* path, const std::vector<instruction>& program, const std::vector<uint32_t>& offsets,
+                               const execution_profile& profile)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+    {
+        perror(path);
+        return false;
+    }
+
+    fprintf(file, "bf-profile 1 %zu %016llx\n", program.size(), static_cast<unsigned long long>(program_fingerprint(program)));
+    for (size_t i = 0; i < program.size(); ++i)
+    {
+        if (program[i].op == OP_JZ)
+            fprintf(file, "%u %llu %llu\n", offsets[i], static_cast<unsigned long long>(profile.counts[i]),
+                    static_cast<unsigned long long>(profile.counts[static_cast<size_t>(program[i].arg)]));
+    }
+
+    if (fclose(file))
+    {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+// Fills counts (indexed like program, set for OP_JZ only) from a profile
+// written by write_loop_profile, warns and returns false if the file is
+// missing or was taken from a different program
+inline bool read_loop_profile(const char* path, const std::vector<instruction>& program, const std::vector<uint32_t>& offsets,
+                              std::vector<loop_counts>& counts)
+{
+    counts.assign(program.size(), loop_counts{ false, 0, 0 });
+
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        perror(path);
+        return false;
+    }
+
+    size_t size;
+    unsigned long long fingerprint;
+    if (fscanf(file, "bf-profile 1 %zu %llx", &size, &fingerprint) != 2 || size != program.size() ||
+        fingerprint != program_fingerprint(program))
+    {
+        fprintf(stderr, "Warning: %s is not a profile of this program, ignoring it\n", path);
+        fclose(file);
+        return false;
+    }
+
+    // Offsets of [ are ascending in both the file and the program
+    unsigned offset;
+    unsigned long long entries, iterations;
+    size_t at = 0;
+    while (fscanf(file, "%u %llu %llu", &offset, &entries, &iterations) == 3)
+    {
+        for (; at < program.size(); ++at)
+        {
+            if (program[at].op == OP_JZ && offsets[at] == offset)
+            {
+                counts[at] = { true, entries, iterations };
+                break;
+            }
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+// How often execution went straight on from instruction i to i + 1 rather
+// than jumping: every time for plain instructions, for ] whenever it did not
+// jump back, for [ whenever the body was entered from it
+inline uint64_t fallthrough_count(const std::vector<instruction>& program, const execution_profile& profile, const size_t i)
+{
+    switch (program[i].op)
+    {
+        case OP_END:
+            return 0;
+        case OP_JNZ:
+            return profile.counts[i] - profile.taken[i];
+        case OP_JZ:
+            return profile.counts[i + 1] - profile.taken[static_cast<size_t>(program[i].arg)];
+        default:
+            return profile.counts[i];
+    }
+}
+
+#define NGRAM_MAX 3
+
+// Writes how often every sequence of 2 to NGRAM_MAX opcodes ran back to back,
+// for mining superinstructions (bench/superinstructions.py). Pairs are exact;
+// longer sequences take the smallest fallthrough count along them, exact
+// unless a jump lands inside.
+inline bool write_ngram_profile(const char* path, const std::vector<instruction>& program, const execution_profile& profile)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+    {
+        perror(path);
+        return false;
+    }
+
+    const size_t ops = OP_END + 1;
+    fprintf(file, "bf-ngrams 1 %llu\n", static_cast<unsigned long long>(profile_total(profile)));
+
+    for (size_t length = 2; length <= NGRAM_MAX; ++length)
+    {
+        // Indexed by the opcodes as digits in base ops
+        size_t size = 1;
+        for (size_t k = 0; k < length; ++k)
+            size *= ops;
+        std::vector<uint64_t> counts(size, 0);
+
+        for (size_t i = 0; i + length <= program.size(); ++i)
+        {
+            uint64_t count = UINT64_MAX;
+            size_t key = program[i].op;
+            for (size_t k = 1; k < length; ++k)
+            {
+                count = std::min(count, fallthrough_count(program, profile, i + k - 1));
+                key = key * ops + program[i + k].op;
+            }
+            counts[key] += count;
+        }
+
+        for (size_t key = 0; key < size; ++key)
+        {
+            if (!counts[key])
+                continue;
+            op_code sequence[NGRAM_MAX];
+            for (size_t k = length, rest = key; k-- > 0; rest /= ops)
+                sequence[k] = static_cast<op_code>(rest % ops);
+
+            fprintf(file, "%llu", static_cast<unsigned long long>(counts[key]));
+            for (size_t k = 0; k < length; ++k)
+                fprintf(file, " %s", op_name(sequence[k]));
+            fprintf(file, "\n");
+        }
+    }
+
+    if (fclose(file))
+    {
+        perror(path);
+        return false;
+    }
+    return true;
+}
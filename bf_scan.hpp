@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BF_SCAN_LANES 32
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BF_SCAN_LANES 16
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+inline int lowest_set_bit(const uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+inline int highest_set_bit(const uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return static_cast<int>(index);
+#else
+    return 31 - __builtin_clz(mask);
+#endif
+}
+
+#ifdef BF_SCAN_LANES
+
+// One bit per cell of the BF_SCAN_LANES cells starting at cells, set where the cell is zero
+inline uint32_t zero_cell_mask(const uint8_t* cells)
+{
+#if BF_SCAN_LANES == 32
+    const __m256i vector = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cells));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(vector, _mm256_setzero_si256())));
+#else
+    const __m128i vector = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cells));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(vector, _mm_setzero_si128())));
+#endif
+}
+
+#endif
+
+// Moves ptr right by stride until it lands on a zero cell, the vector loads
+// never read at or past end
+inline uint8_t* scan_right(uint8_t* ptr, const int32_t stride, uint8_t* const end)
+{
+    if (stride == 1)
+    {
+        uint8_t* const found = ptr < end ? static_cast<uint8_t*>(memchr(ptr, 0, end - ptr)) : nullptr;
+        return found ? found : end;
+    }
+
+#ifdef BF_SCAN_LANES
+    if (stride <= BF_SCAN_LANES)
+    {
+        // Only lanes 0, stride, 2 * stride, ... are cells the loop would visit
+        uint32_t lanes = 0;
+        for (int i = 0; i < BF_SCAN_LANES; i += stride)
+            lanes |= 1u << i;
+        const int32_t step = BF_SCAN_LANES - BF_SCAN_LANES % stride;
+
+        for (; end - ptr >= BF_SCAN_LANES; ptr += step)
+        {
+            const uint32_t zeros = zero_cell_mask(ptr) & lanes;
+            if (zeros)
+                return ptr + lowest_set_bit(zeros);
+        }
+    }
+#endif
+
+    while (ptr < end && *ptr)
+        ptr += stride;
+    return ptr;
+}
+
+// Moves ptr left by stride until it lands on a zero cell, the vector loads
+// never read before begin
+inline uint8_t* scan_left(uint8_t* ptr, const int32_t stride, uint8_t* const begin)
+{
+#ifdef __GLIBC__
+    if (stride == 1)
+    {
+        uint8_t* const found = ptr >= begin ? static_cast<uint8_t*>(memrchr(begin, 0, ptr - begin + 1)) : nullptr;
+        return found ? found : begin - 1;
+    }
+#endif
+
+#ifdef BF_SCAN_LANES
+    if (stride <= BF_SCAN_LANES)
+    {
+        // The window ends at ptr, so the visited cells are the top lanes
+        uint32_t lanes = 0;
+        for (int i = BF_SCAN_LANES - 1; i >= 0; i -= stride)
+            lanes |= 1u << i;
+        const int32_t step = BF_SCAN_LANES - BF_SCAN_LANES % stride;
+
+        for (; ptr - begin >= BF_SCAN_LANES - 1; ptr -= step)
+        {
+            uint8_t* const window = ptr - (BF_SCAN_LANES - 1);
+            const uint32_t zeros = zero_cell_mask(window) & lanes;
+            if (zeros)
+                return window + highest_set_bit(zeros);
+        }
+    }
+#endif
+
+    while (ptr >= begin && *ptr)
+        ptr -= stride;
+    return ptr;
+}
+
+// Cells wider than a byte get the plain loops, bounded the same way
+template <typename cell>
+inline cell* scan_right(cell* ptr, const int32_t stride, cell* const end)
+{
+    while (ptr < end && *ptr)
+        ptr += stride;
+    return ptr;
+}
+
+template <typename cell>
+inline cell* scan_left(cell* ptr, const int32_t stride, cell* const begin)
+{
+    while (ptr >= begin && *ptr)
+        ptr -= stride;
+    return ptr;
+}
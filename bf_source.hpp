@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Program text, either mapped straight from the file or, for pipes, stdin and
+// anything else that cannot be mapped, streamed into buffer
+struct source_file
+{
+    const char* data;
+    size_t size;
+    bool mapped;
+    std::vector<char> buffer;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#endif
+};
+
+inline bool stream_source(FILE* file, source_file& source)
+{
+    char chunk[65536];
+    size_t bytes_read;
+
+    while ((bytes_read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        source.buffer.insert(source.buffer.end(), chunk, chunk + bytes_read);
+
+    source.data = source.buffer.data();
+    source.size = source.buffer.size();
+    return !ferror(file);
+}
+
+// Opens path ("-" for stdin), prints the reason and returns false on failure
+inline bool open_source(const char* path, source_file& source)
+{
+    source.data = nullptr;
+    source.size = 0;
+    source.mapped = false;
+
+    if (strcmp(path, "-") == 0)
+    {
+        if (!stream_source(stdin, source))
+        {
+            perror("Error reading program from stdin");
+            return false;
+        }
+        return true;
+    }
+
+#ifdef _WIN32
+    source.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (source.file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Error: Could not open file %s\n", path);
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (GetFileType(source.file) == FILE_TYPE_DISK && GetFileSizeEx(source.file, &size) && size.QuadPart > 0)
+    {
+        source.mapping = CreateFileMappingA(source.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        const void* view = source.mapping ? MapViewOfFile(source.mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+
+        if (view)
+        {
+            source.data = static_cast<const char*>(view);
+            source.size = static_cast<size_t>(size.QuadPart);
+            source.mapped = true;
+            return true;
+        }
+        if (source.mapping)
+            CloseHandle(source.mapping);
+    }
+    CloseHandle(source.file);
+#else
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not open file %s\n", path);
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (view != MAP_FAILED)
+        {
+            madvise(view, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+            close(fd);
+            source.data = static_cast<const char*>(view);
+            source.size = static_cast<size_t>(info.st_size);
+            source.mapped = true;
+            return true;
+        }
+    }
+    close(fd);
+#endif
+
+    // Not mappable (FIFO, device, empty file...), read it the slow way
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Error: Could not open file %s\n", path);
+        return false;
+    }
+
+    const bool read_ok = stream_source(file, source);
+    fclose(file);
+
+    if (!read_ok)
+        fprintf(stderr, "Error: Could not read file %s\n", path);
+    return read_ok;
+}
+
+inline void close_source(source_file& source)
+{
+    if (source.mapped)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(source.data);
+        CloseHandle(source.mapping);
+        CloseHandle(source.file);
+#else
+        munmap(const_cast<char*>(source.data), source.size);
+#endif
+    }
+    source.buffer.clear();
+    source.data = nullptr;
+    source.size = 0;
+    source.mapped = false;
+}
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+// The tape is one reserved stretch of address space with inaccessible guard
+// regions on both sides. Only its start is accessible at first; touching a
+// cell past that commits more from the fault handler and retries the access,
+// so the engines never check bounds. Running into a guard region ends the
+// run with an error instead of corrupting memory.
+#define DEFAULT_TAPE_SIZE (1ull << 30)
+#define TAPE_INITIAL_COMMIT (64u << 10)
+#define TAPE_GUARD_SIZE (1u << 20)
+#define TAPE_MAX_OPEN 64
+
+struct tape_region
+{
+    uint8_t* cells;         // the first cell
+    uint8_t* end;           // one past the last cell
+    uint8_t* committed;     // cells below this are accessible
+    size_t page_size;
+    void* escape;           // sigjmp_buf a tape error jumps to, the process ends if null
+};
+
+// The fault handler gets no context, it finds the faulting tape among the
+// open ones by address
+inline std::atomic<tape_region*>* open_tapes()
+{
+    static std::atomic<tape_region*> tapes[TAPE_MAX_OPEN];
+    return tapes;
+}
+
+// Guards opening and closing, never taken in the fault handler
+inline std::mutex& open_tapes_lock()
+{
+    static std::mutex lock;
+    return lock;
+}
+
+// Reads a size in bytes with an optional K, M or G suffix
+inline bool parse_size(const char* text, size_t& size)
+{
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text)
+        return false;
+
+    switch (*end)
+    {
+        case 'K': case 'k':
+            value <<= 10;
+            ++end;
+            break;
+        case 'M': case 'm':
+            value <<= 20;
+            ++end;
+            break;
+        case 'G': case 'g':
+            value <<= 30;
+            ++end;
+            break;
+    }
+
+    if (*end || !value)
+        return false;
+    size = static_cast<size_t>(value);
+    return true;
+}
+
+// Reads a cell width for --cell-bits/-cell-bits: 8, 16, 32 or 64
+inline bool parse_cell_bits(const char* text, unsigned& bits)
+{
+    char* end;
+    const unsigned long value = strtoul(text, &end, 10);
+    if (end == text || *end || (value != 8 && value != 16 && value != 32 && value != 64))
+        return false;
+    bits = static_cast<unsigned>(value);
+    return true;
+}
+
+// Makes the cells up to the page holding address accessible, committing at
+// least as much again as is committed already
+inline bool commit_tape(tape_region& tape, const uint8_t* address)
+{
+    const size_t used = static_cast<size_t>(tape.committed - tape.cells);
+    size_t wanted = (static_cast<size_t>(address - tape.cells) / tape.page_size + 1) * tape.page_size;
+    if (wanted < used * 2)
+        wanted = used * 2;
+    if (wanted > static_cast<size_t>(tape.end - tape.cells))
+        wanted = static_cast<size_t>(tape.end - tape.cells);
+
+#ifdef _WIN32
+    if (!VirtualAlloc(tape.committed, wanted - used, MEM_COMMIT, PAGE_READWRITE))
+        return false;
+#else
+    if (mprotect(tape.committed, wanted - used, PROT_READ | PROT_WRITE))
+        return false;
+#endif
+    tape.committed = tape.cells + wanted;
+    return true;
+}
+
+// Called from the fault handler, where stdio is off limits: prints message and
+// jumps to the tape's escape, or ends the process if there is none
+inline void tape_error(const tape_region& tape, const char* message)
+{
+#ifdef _WIN32
+    (void)tape;
+    DWORD written;
+    WriteFile(GetStdHandle(STD_ERROR_HANDLE), message, static_cast<DWORD>(strlen(message)), &written, nullptr);
+    ExitProcess(EXIT_FAILURE);
+#else
+    const ssize_t written = write(2, message, strlen(message));
+    (void)written;
+    if (tape.escape)
+        siglongjmp(*static_cast<sigjmp_buf*>(tape.escape), 1);
+    _exit(EXIT_FAILURE);
+#endif
+}
+
+// Grows the tape over a fault past its committed part and returns true, ends
+// the run on a fault in a guard region and returns false for faults that
+// have nothing to do with any tape
+inline bool handle_tape_fault(const uint8_t* address)
+{
+    std::atomic<tape_region*>* const tapes = open_tapes();
+
+    for (int i = 0; i < TAPE_MAX_OPEN; ++i)
+    {
+        tape_region* const tape = tapes[i].load(std::memory_order_acquire);
+        if (!tape || address < tape->cells - TAPE_GUARD_SIZE || address >= tape->end + TAPE_GUARD_SIZE)
+            continue;
+
+        if (address >= tape->committed && address < tape->end)
+        {
+            if (commit_tape(*tape, address))
+                return true;
+            tape_error(*tape, "Error: Out of memory growing the tape\n");
+        }
+        if (address < tape->cells)
+            tape_error(*tape, "Error: The program moved left of the first cell\n");
+        if (address >= tape->end)
+            tape_error(*tape, "Error: The program ran past the end of the tape, give it a larger tape size\n");
+    }
+    return false;
+}
+
+#ifdef _WIN32
+
+// The handle AddVectoredExceptionHandler returned
+inline void*& tape_fault_handler()
+{
+    static void* handler = nullptr;
+    return handler;
+}
+
+inline LONG WINAPI tape_fault(EXCEPTION_POINTERS* info)
+{
+    const EXCEPTION_RECORD* const record = info->ExceptionRecord;
+    if (record->ExceptionCode == EXCEPTION_ACCESS_VIOLATION &&
+        handle_tape_fault(reinterpret_cast<const uint8_t*>(record->ExceptionInformation[1])))
+        return EXCEPTION_CONTINUE_EXECUTION;
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+#else
+
+// The SIGSEGV action in place before the first tape opened, put back when the
+// last one closes
+inline struct sigaction& previous_fault_action()
+{
+    static struct sigaction action;
+    return action;
+}
+
+inline void tape_fault(int signal_number, siginfo_t* info, void* context)
+{
+    if (handle_tape_fault(static_cast<const uint8_t*>(info->si_addr)))
+        return;
+
+    // Not ours: the previous handler gets it, or with none the access repeats
+    // and crashes the usual way
+    const struct sigaction& previous = previous_fault_action();
+    if ((previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction)
+        previous.sa_sigaction(signal_number, info, context);
+    else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)
+        previous.sa_handler(signal_number);
+    else
+        signal(SIGSEGV, SIG_DFL);
+}
+
+#endif
+
+// Gives the reservation back
+inline void release_tape(tape_region& tape)
+{
+#ifdef _WIN32
+    VirtualFree(tape.cells - TAPE_GUARD_SIZE, 0, MEM_RELEASE);
+#else
+    munmap(tape.cells - TAPE_GUARD_SIZE, static_cast<size_t>(tape.end - tape.cells) + 2 * TAPE_GUARD_SIZE);
+#endif
+    tape = { nullptr, nullptr, nullptr, 0, nullptr };
+}
+
+// Reserves a zeroed tape of size bytes (rounded up to whole pages) for tape,
+// which must stay where it is until close_tape, and installs the fault
+// handler. Prints the reason and returns false on failure.
+inline bool open_tape(tape_region& tape, const size_t size)
+{
+    tape = { nullptr, nullptr, nullptr, 0, nullptr };
+
+#ifdef _WIN32
+    SYSTEM_INFO system;
+    GetSystemInfo(&system);
+    tape.page_size = system.dwPageSize;
+#else
+    tape.page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+
+    const size_t cells = (size + tape.page_size - 1) / tape.page_size * tape.page_size;
+    const size_t total = TAPE_GUARD_SIZE + cells + TAPE_GUARD_SIZE;
+
+#ifdef _WIN32
+    uint8_t* const base = static_cast<uint8_t*>(VirtualAlloc(nullptr, total, MEM_RESERVE, PAGE_NOACCESS));
+    if (!base)
+    {
+        fprintf(stderr, "Error: Cannot reserve a tape of %zu bytes\n", size);
+        return false;
+    }
+#else
+    void* const view = mmap(nullptr, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (view == MAP_FAILED)
+    {
+        perror("Error reserving the tape");
+        return false;
+    }
+    uint8_t* const base = static_cast<uint8_t*>(view);
+#endif
+
+    tape.cells = base + TAPE_GUARD_SIZE;
+    tape.end = tape.cells + cells;
+    tape.committed = tape.cells;
+
+    if (!commit_tape(tape, tape.cells + (cells < TAPE_INITIAL_COMMIT ? cells : TAPE_INITIAL_COMMIT) - 1))
+    {
+        perror("Error committing the tape");
+        release_tape(tape);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(open_tapes_lock());
+    std::atomic<tape_region*>* const tapes = open_tapes();
+    int slot = 0;
+    while (slot < TAPE_MAX_OPEN && tapes[slot].load())
+        ++slot;
+    if (slot == TAPE_MAX_OPEN)
+    {
+        fprintf(stderr, "Error: More than %i tapes open at once\n", TAPE_MAX_OPEN);
+        release_tape(tape);
+        return false;
+    }
+
+    // The first open tape installs the handler, keeping the one it replaces
+    bool first = true;
+    for (int i = 0; i < TAPE_MAX_OPEN; ++i)
+        first = first && !tapes[i].load();
+    if (first)
+    {
+#ifdef _WIN32
+        tape_fault_handler() = AddVectoredExceptionHandler(1, tape_fault);
+#else
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = tape_fault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous_fault_action());
+#endif
+    }
+    tapes[slot].store(&tape, std::memory_order_release);
+    return true;
+}
+
+// Zeroes every cell for the next run, keeping the reservation and the
+// memory committed so far
+inline void clear_tape(tape_region& tape)
+{
+    const size_t used = static_cast<size_t>(tape.committed - tape.cells);
+
+#ifdef __linux__
+    // Large tapes are cheaper to hand back, the kernel zero-fills them on the next touch
+    if (used > TAPE_INITIAL_COMMIT && !madvise(tape.cells, used, MADV_DONTNEED))
+        return;
+#endif
+    memset(tape.cells, 0, used);
+}
+
+// Unregisters and releases the tape, putting the fault handling from before
+// the first tape back once no tape is left open
+inline void close_tape(tape_region& tape)
+{
+    if (!tape.cells)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(open_tapes_lock());
+        std::atomic<tape_region*>* const tapes = open_tapes();
+        bool last = true;
+        for (int i = 0; i < TAPE_MAX_OPEN; ++i)
+        {
+            if (tapes[i].load() == &tape)
+                tapes[i].store(nullptr);
+            last = last && !tapes[i].load();
+        }
+
+        if (last)
+        {
+#ifdef _WIN32
+            if (tape_fault_handler())
+                RemoveVectoredExceptionHandler(tape_fault_handler());
+            tape_fault_handler() = nullptr;
+#else
+            sigaction(SIGSEGV, &previous_fault_action(), nullptr);
+#endif
+        }
+    }
+
+    release_tape(tape);
+}
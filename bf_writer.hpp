@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// Collects generated source in memory and writes it out with a single call
+// at the end. Text is appended straight into spare capacity, which doubles
+// through realloc when it runs out (large blocks grow without being copied
+// or cleared), so printing a token costs no stream locking and, for plain
+// text and integers, no format parsing either.
+struct text_writer
+{
+    char* data = nullptr;
+    size_t length = 0, capacity = 0;
+
+    text_writer() = default;
+    text_writer(const text_writer&) = delete;
+    text_writer& operator=(const text_writer&) = delete;
+    ~text_writer() { free(data); }
+};
+
+// Makes room for size more bytes and returns where they go
+inline char* reserve_text(text_writer& out, const size_t size)
+{
+    if (out.length + size > out.capacity)
+    {
+        const size_t capacity = out.capacity * 2 > out.length + size ? out.capacity * 2 : out.length + size + 65536;
+        char* const data = static_cast<char*>(realloc(out.data, capacity));
+        if (!data)
+            throw std::bad_alloc();
+        out.data = data;
+        out.capacity = capacity;
+    }
+    return out.data + out.length;
+}
+
+inline void write_text(text_writer& out, const char* text, const size_t size)
+{
+    memcpy(reserve_text(out, size), text, size);
+    out.length += size;
+}
+
+inline void write_text(text_writer& out, const char* text)
+{
+    write_text(out, text, strlen(text));
+}
+
+inline void write_char(text_writer& out, const char chr)
+{
+    *reserve_text(out, 1) = chr;
+    ++out.length;
+}
+
+inline void write_int(text_writer& out, const int64_t value)
+{
+    char digits[20];
+    size_t count = 0;
+    uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+    do
+    {
+        digits[count++] = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+
+    char* at = reserve_text(out, count + 1);
+    if (value < 0)
+        *at++ = '-';
+    while (count)
+        *at++ = digits[--count];
+    out.length = static_cast<size_t>(at - out.data);
+}
+
+// printf into the writer, for the few places that need real formatting
+inline void write_format(text_writer& out, const char* format, ...)
+{
+    va_list args, retry;
+    va_start(args, format);
+    va_copy(retry, args);
+
+    const size_t room = out.capacity - out.length;
+    const int size = vsnprintf(out.data + out.length, room, format, args);
+    if (size >= 0 && static_cast<size_t>(size) >= room)
+        vsnprintf(reserve_text(out, static_cast<size_t>(size) + 1), static_cast<size_t>(size) + 1, format, retry);
+    if (size > 0)
+        out.length += static_cast<size_t>(size);
+
+    va_end(retry);
+    va_end(args);
+}
+
+// Writes everything collected to path, prints the reason and returns false
+// on failure
+inline bool write_text_file(const text_writer& out, const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        perror(path);
+        return false;
+    }
+
+    const bool written = fwrite(out.data, 1, out.length, file) == out.length;
+    if (fclose(file) || !written)
+    {
+        perror(path);
+        return false;
+    }
+    return true;
+}